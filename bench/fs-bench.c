@@ -0,0 +1,399 @@
+// Workload benchmark: replays reproducible synthetic command traces against
+// fresh 128 KB images and reports throughput and per-command latency.
+//
+// Each workload generates a trace of command lines from a seeded generator,
+// mounts a new zeroed image and runs every line through fs_run_commands() in
+// a fresh context, timing each one. Latencies are grouped by the fs_* entry point the
+// opcode dispatches to. With -t DIR the traces are also written out as
+// command files (mounting "disk") so they can be replayed with ./fs.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../fs-sim.h"
+
+#define BLOCK_SIZE 1024
+#define NUM_BLOCKS 128
+
+#define DEFAULT_OPS 20000
+#define MAX_LIVE 48
+
+typedef struct {
+    char *text;
+    size_t len;
+    size_t cap;
+    int count;
+} Trace;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*generate)(Trace *trace, int ops);
+} Workload;
+
+// Entry points, indexed by opcode
+static const struct {
+    char op;
+    const char *name;
+} entry_points[] = {
+    {'C', "fs_create"}, {'D', "fs_delete"}, {'R', "fs_read"}, {'W', "fs_write"},
+    {'B', "fs_buff"}, {'L', "fs_ls"}, {'E', "fs_resize"}, {'O', "fs_defrag"},
+    {'F', "fs_frag"}, {'Y', "fs_cd"},
+};
+#define NUM_ENTRY_POINTS (int)(sizeof(entry_points) / sizeof(entry_points[0]))
+
+typedef struct {
+    double *samples;
+    int count;
+    int cap;
+} Latencies;
+
+static Latencies latencies[NUM_ENTRY_POINTS];
+
+static uint64_t rng_state;
+
+static uint32_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+static int rand_range(int lo, int hi) {
+    return lo + (int)(next_rand() % (uint32_t)(hi - lo + 1));
+}
+
+static void emit(Trace *trace, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void emit(Trace *trace, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        size_t room = trace->cap - trace->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(trace->text + trace->len, room, fmt, ap);
+        va_end(ap);
+        if ((size_t)n + 1 < room) {
+            trace->len += n;
+            trace->text[trace->len++] = '\n';
+            trace->count++;
+            return;
+        }
+        trace->cap = trace->cap ? trace->cap * 2 : 65536;
+        trace->text = realloc(trace->text, trace->cap);
+    }
+}
+
+// Live files of the generators' model of the disk
+typedef struct {
+    char name[6];
+    int size;
+} LiveFile;
+
+static LiveFile live[MAX_LIVE];
+static int num_live;
+static int name_counter;
+
+static void reset_model(void) {
+    num_live = 0;
+    name_counter = 0;
+}
+
+static void fresh_name(char name[6]) {
+    snprintf(name, 6, "f%04u", (unsigned)name_counter++ % 10000u);
+}
+
+static void create_live(Trace *trace, int size) {
+    LiveFile *f = &live[num_live++];
+    fresh_name(f->name);
+    f->size = size;
+    emit(trace, "C %s %d", f->name, size);
+}
+
+static void delete_live(Trace *trace, int i) {
+    emit(trace, "D %s", live[i].name);
+    live[i] = live[--num_live];
+}
+
+static void fill_buffer_line(Trace *trace) {
+    char data[65];
+    for (int i = 0; i < 64; i++) data[i] = 'a' + next_rand() % 26;
+    data[64] = '\0';
+    emit(trace, "B %s", data);
+}
+
+// Create/delete churn of small files in the root directory
+static void gen_churn(Trace *trace, int ops) {
+    while (trace->count < ops) {
+        if (num_live == 0 || (num_live < MAX_LIVE && next_rand() % 2)) {
+            create_live(trace, rand_range(1, 4));
+        } else {
+            delete_live(trace, rand_range(0, num_live - 1));
+        }
+    }
+}
+
+// A fixed set of files read at random blocks
+static void gen_read(Trace *trace, int ops) {
+    for (int i = 0; i < 30; i++) create_live(trace, 4);
+    while (trace->count < ops) {
+        LiveFile *f = &live[rand_range(0, num_live - 1)];
+        emit(trace, "R %s %d", f->name, rand_range(0, f->size - 1));
+    }
+}
+
+// Buffer refills and random block writes to a fixed set of files
+static void gen_write(Trace *trace, int ops) {
+    for (int i = 0; i < 30; i++) create_live(trace, 4);
+    while (trace->count < ops) {
+        if (next_rand() % 4 == 0) fill_buffer_line(trace);
+        LiveFile *f = &live[rand_range(0, num_live - 1)];
+        emit(trace, "W %s %d", f->name, rand_range(0, f->size - 1));
+    }
+}
+
+// Walk down and up a chain of nested directories, listing and creating
+// files along the way. The chain is removed bottom-up on the way back so
+// the tree never runs out of inodes.
+static void gen_tree(Trace *trace, int ops) {
+    static const int depth = 24;
+    char dirs[24][6];
+    for (int d = 0; d < depth; d++) snprintf(dirs[d], 6, "d%02d", d);
+
+    // Inode 0 doubles as the root, so a directory placed there would be
+    // its own child; occupy it with a file first
+    emit(trace, "C base 1");
+    while (trace->count < ops) {
+        for (int d = 0; d < depth; d++) {
+            emit(trace, "C %s 0", dirs[d]);
+            emit(trace, "Y %s", dirs[d]);
+            emit(trace, "C leaf 1");
+            emit(trace, "L");
+        }
+        for (int d = depth - 1; d >= 0; d--) {
+            emit(trace, "D leaf");
+            emit(trace, "Y ..");
+            emit(trace, "D %s", dirs[d]);
+            if (next_rand() % 2) emit(trace, "L");
+        }
+    }
+}
+
+// Files repeatedly grown and shrunk, forcing relocations
+static void gen_resize(Trace *trace, int ops) {
+    for (int i = 0; i < 16; i++) create_live(trace, rand_range(1, 4));
+    while (trace->count < ops) {
+        LiveFile *f = &live[rand_range(0, num_live - 1)];
+        f->size = rand_range(1, 12);
+        emit(trace, "E %s %d", f->name, f->size);
+    }
+}
+
+// Fill the disk, punch holes by deleting every other file, then defragment
+static void gen_defrag(Trace *trace, int ops) {
+    while (trace->count < ops) {
+        while (num_live < MAX_LIVE) create_live(trace, rand_range(1, 4));
+        for (int i = num_live - 1; i >= 0; i -= 2) delete_live(trace, i);
+        emit(trace, "F");
+        emit(trace, "O");
+        emit(trace, "F");
+    }
+}
+
+static const Workload workloads[] = {
+    {"churn", "create/delete churn", gen_churn},
+    {"read", "random block reads", gen_read},
+    {"write", "buffer fills and block writes", gen_write},
+    {"tree", "deep directory trees", gen_tree},
+    {"resize", "resize storms", gen_resize},
+    {"defrag", "fragmentation then defrag", gen_defrag},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int entry_point_of(char op) {
+    for (int i = 0; i < NUM_ENTRY_POINTS; i++) {
+        if (entry_points[i].op == op) return i;
+    }
+    return -1;
+}
+
+static void record(int entry, double ns) {
+    Latencies *l = &latencies[entry];
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->samples = realloc(l->samples, l->cap * sizeof(double));
+    }
+    l->samples[l->count++] = ns;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const Latencies *l, double p) {
+    int i = (int)(p * (l->count - 1) + 0.5);
+    return l->samples[i];
+}
+
+// A fresh image: superblock block in use, everything else free
+static int make_image(const char *path) {
+    char block[BLOCK_SIZE] = {0};
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    block[0] = (char)0x80;
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+            close(fd);
+            return -1;
+        }
+        block[0] = 0;
+    }
+    close(fd);
+    return 0;
+}
+
+static int dump_trace(const char *dir, const Workload *w, const Trace *trace) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.input", dir, w->name);
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "M disk\n");
+    fwrite(trace->text, 1, trace->len, f);
+    return fclose(f);
+}
+
+// Runs the trace line by line in a new context whose output is discarded
+static double run_trace(const Trace *trace, const char *image, FILE *quiet) {
+    double total = 0;
+    char mount_line[4200];
+    snprintf(mount_line, sizeof(mount_line), "M %s", image);
+
+    FsContext *ctx = fs_context_new();
+    fs_set_output(ctx, quiet, quiet);
+    fs_run_commands(ctx, mount_line, strlen(mount_line), "bench");
+
+    const char *pos = trace->text;
+    const char *end = trace->text + trace->len;
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        size_t len = newline - pos;
+        int entry = entry_point_of(pos[0]);
+        double start = now_ns();
+        fs_run_commands(ctx, pos, len, "bench");
+        double elapsed = now_ns() - start;
+        total += elapsed;
+        if (entry >= 0) record(entry, elapsed);
+        pos = newline + 1;
+    }
+    fs_context_free(ctx);
+    return total;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n ops] [-r seed] [-w workload] [-t trace_dir]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int ops = DEFAULT_OPS;
+    uint64_t seed = 1;
+    const char *only = NULL;
+    const char *trace_dir = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:w:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 'r':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'w':
+                only = optarg;
+                break;
+            case 't':
+                trace_dir = optarg;
+                break;
+            default:
+                bench_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (ops <= 0 || optind != argc) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/fs-bench.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "Error: Cannot create temporary directory\n");
+        return 1;
+    }
+    char image[sizeof(dir) + 8];
+    snprintf(image, sizeof(image), "%s/disk", dir);
+
+    FILE *quiet = fopen("/dev/null", "w");
+    if (!quiet) {
+        fprintf(stderr, "Error: Cannot open /dev/null\n");
+        return 1;
+    }
+
+    int ran = 0;
+    printf("%-8s %-10s %8s %12s %12s %12s\n", "workload", "entry", "ops", "ops/sec", "p50 ns", "p99 ns");
+    for (int w = 0; w < NUM_WORKLOADS; w++) {
+        if (only && strcmp(only, workloads[w].name) != 0) continue;
+        ran++;
+
+        Trace trace = {0};
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + w + 1;
+        reset_model();
+        workloads[w].generate(&trace, ops);
+
+        if (trace_dir && dump_trace(trace_dir, &workloads[w], &trace) != 0) {
+            fprintf(stderr, "Error: Cannot write trace to %s: %s\n", trace_dir, strerror(errno));
+            return 1;
+        }
+        if (make_image(image) != 0) {
+            fprintf(stderr, "Error: Cannot create image %s\n", image);
+            return 1;
+        }
+
+        for (int i = 0; i < NUM_ENTRY_POINTS; i++) latencies[i].count = 0;
+        double total = run_trace(&trace, image, quiet);
+
+        printf("%-8s %-10s %8d %12.0f %12s %12s\n", workloads[w].name, "(all)",
+               trace.count, trace.count / (total / 1e9), "", "");
+        for (int i = 0; i < NUM_ENTRY_POINTS; i++) {
+            Latencies *l = &latencies[i];
+            if (l->count == 0) continue;
+            double sum = 0;
+            for (int j = 0; j < l->count; j++) sum += l->samples[j];
+            qsort(l->samples, l->count, sizeof(double), compare_double);
+            printf("%-8s %-10s %8d %12.0f %12.0f %12.0f\n", "", entry_points[i].name, l->count,
+                   l->count / (sum / 1e9), percentile(l, 0.50), percentile(l, 0.99));
+        }
+        free(trace.text);
+    }
+
+    fclose(quiet);
+    unlink(image);
+    rmdir(dir);
+    for (int i = 0; i < NUM_ENTRY_POINTS; i++) free(latencies[i].samples);
+
+    if (ran == 0) {
+        fprintf(stderr, "Error: Unknown workload %s\n", only);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+// Microbenchmark: name index lookup vs. the original linear inode scan.
+//
+// Builds full superblocks (all 126 inodes in use) and times get_file_inode
+// against a copy of the scan it replaced, for hits and misses.
+#include "../fs-sim.c"
+
+#define LOOKUPS 2000000
+
+static volatile long sink;  // Keeps the lookups from being optimized away
+static FsContext *ctx;
+
+static int scan_file_inode(FsContext *ctx, const char name[5], int parent_inode) {
+    for (int i = 0; i < NUM_INODES; i++) {
+        if ((ctx->superblock.inode[i].used_size & 0x80) &&
+            (ctx->superblock.inode[i].dir_parent & 0x7F) == parent_inode &&
+            memcmp(ctx->superblock.inode[i].name, name, 5) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t rng_state = 12345;
+
+static uint32_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Fill every inode: the first num_dirs are directories in root, the rest are
+// 1-block files spread over those directories
+static void fill_superblock(int num_dirs) {
+    memset(&ctx->superblock, 0, sizeof(ctx->superblock));
+    for (int i = 0; i < NUM_INODES; i++) {
+        for (int j = 0; j < 5; j++) {
+            ctx->superblock.inode[i].name[j] = 'a' + next_rand() % 26;
+        }
+        if (i < num_dirs) {
+            ctx->superblock.inode[i].used_size = 0x80;
+            ctx->superblock.inode[i].dir_parent = 0x80;
+        } else {
+            ctx->superblock.inode[i].used_size = 0x81;
+            ctx->superblock.inode[i].start_block = 1;
+            ctx->superblock.inode[i].dir_parent = num_dirs ? next_rand() % num_dirs : 0;
+        }
+    }
+    rebuild_indexes(ctx);
+}
+
+static double time_lookups(int (*lookup)(FsContext *, const char *, int), const int *targets,
+                           int miss, long *checksum) {
+    char name[5];
+    double start = now_ns();
+    for (int n = 0; n < LOOKUPS; n++) {
+        const Inode *inode = &ctx->superblock.inode[targets[n & 1023]];
+        memcpy(name, inode->name, 5);
+        if (miss) name[0] = '#';  // Never generated, so the lookup fails
+        *checksum += lookup(ctx, name, inode->dir_parent & 0x7F);
+    }
+    return (now_ns() - start) / LOOKUPS;
+}
+
+int main(void) {
+    static const int dir_counts[] = {0, 8, 40};
+    int targets[1024];
+    long checksum = 0;
+
+    ctx = fs_context_new();
+    printf("%-28s %12s %12s %8s\n", "superblock (126 inodes)", "scan ns/op", "index ns/op", "speedup");
+    for (size_t d = 0; d < sizeof(dir_counts) / sizeof(dir_counts[0]); d++) {
+        fill_superblock(dir_counts[d]);
+        for (int i = 0; i < 1024; i++) {
+            targets[i] = next_rand() % NUM_INODES;
+        }
+
+        // Both implementations must agree before timing them
+        for (int i = 0; i < NUM_INODES; i++) {
+            const Inode *inode = &ctx->superblock.inode[i];
+            if (scan_file_inode(ctx, inode->name, inode->dir_parent & 0x7F) !=
+                get_file_inode(ctx, inode->name, inode->dir_parent & 0x7F)) {
+                fprintf(stderr, "Error: index and scan disagree on inode %d\n", i);
+                return 1;
+            }
+        }
+
+        for (int miss = 0; miss <= 1; miss++) {
+            double scan = time_lookups(scan_file_inode, targets, miss, &checksum);
+            double index = time_lookups(get_file_inode, targets, miss, &checksum);
+            char label[64];
+            snprintf(label, sizeof(label), "%d dirs, %s", dir_counts[d], miss ? "misses" : "hits");
+            printf("%-28s %12.1f %12.1f %7.1fx\n", label, scan, index, scan / index);
+        }
+    }
+    sink = checksum;
+    fs_context_free(ctx);
+    return 0;
+}
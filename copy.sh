@@ -2,6 +2,6 @@
 
 file_to_copy="fs"
 
-for dir in tests/test1 tests/test2 tests/test3 tests/test4; do
+for dir in tests/test1 tests/test2 tests/test3 tests/test4 tests/test5 tests/test6 tests/test7 tests/test8; do
     cp "$file_to_copy" "$dir"
 done
\ No newline at end of file
@@ -0,0 +1,749 @@
+// Command-line front end: runs a command file, runs many of them in parallel
+// (batch mode), or serves command files over a Unix socket (daemon mode) and
+// sends them to one (client mode).
+#define _GNU_SOURCE  // ppoll
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "fs-sim.h"
+
+// Context settings from the command line, applied to every context created
+typedef struct {
+    int flush_interval;
+    int flush_ms;
+    int journal;
+    AllocPolicy alloc_policy;
+    int defrag_budget;
+    int timing;
+    int punch_holes;
+    AioEngine aio;
+    int block_cache;
+} Settings;
+
+static FsContext *new_context(const Settings *settings) {
+    FsContext *ctx = fs_context_new();
+    if (!ctx) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    fs_set_flush_interval(ctx, settings->flush_interval);
+    fs_set_flush_ms(ctx, settings->flush_ms);
+    fs_set_journal(ctx, settings->journal);
+    fs_set_alloc_policy(ctx, settings->alloc_policy);
+    fs_set_defrag_budget(ctx, settings->defrag_budget);
+    fs_set_timing(ctx, settings->timing);
+    fs_set_hole_punching(ctx, settings->punch_holes);
+    fs_set_async_io(ctx, settings->aio);
+    fs_set_block_cache(ctx, settings->block_cache);
+    return ctx;
+}
+
+static void free_command_file(char *data, size_t size, int mapped) {
+    if (mapped) {
+        munmap(data, size);
+    } else {
+        free(data);
+    }
+}
+
+// Map the command file, or read it whole when it cannot be mapped (pipes,
+// empty files). Returns -1 if the file cannot be opened.
+static int load_command_file(const char *path, char **data, size_t *size, int *mapped) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    *data = NULL;
+    *size = 0;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *data = map;
+            *size = st.st_size;
+            *mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    size_t capacity = 0;
+    for (;;) {
+        if (*size == capacity) {
+            capacity = capacity ? capacity * 2 : 65536;
+            *data = realloc(*data, capacity);
+        }
+        ssize_t n = read(fd, *data + *size, capacity - *size);
+        if (n <= 0) break;
+        *size += n;
+    }
+    close(fd);
+    return 0;
+}
+
+// Daemon mode. Requests and replies on the Unix socket are framed with
+// native-endian lengths:
+//   request: u32 length, client cwd; u32 length, script name;
+//            u64 length, script
+//   reply:   u64 length, stdout; u64 length, stderr
+// One request per connection; requests are served one at a time. A client
+// that sends or reads nothing for REQUEST_TIMEOUT_SECONDS is dropped, so it
+// cannot hold up the others or a shutdown.
+#define MAX_FRAME (1UL << 30)
+#define REQUEST_TIMEOUT_SECONDS 10
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// With wait_mask (the daemon), each wait for data is bounded by the
+// request timeout and ended by a shutdown signal
+static int read_full(int fd, void *data, size_t len, const sigset_t *wait_mask) {
+    char *p = data;
+    while (len > 0) {
+        if (wait_mask) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            struct timespec timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+            int ready = ppoll(&pfd, 1, &timeout, wait_mask);
+            if (ready == -1 && errno == EINTR && !daemon_stop) continue;
+            if (ready <= 0) return -1;
+        }
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads a frame whose length is a u32 (wide = 0) or u64 (wide = 1); the
+// data is NUL-terminated for convenience
+static char *read_frame(int fd, int wide, size_t *len, const sigset_t *wait_mask) {
+    uint64_t length;
+    if (wide) {
+        if (read_full(fd, &length, sizeof(length), wait_mask) == -1) return NULL;
+    } else {
+        uint32_t short_length;
+        if (read_full(fd, &short_length, sizeof(short_length), wait_mask) == -1) return NULL;
+        length = short_length;
+    }
+    if (length > MAX_FRAME) return NULL;
+
+    char *data = malloc(length + 1);
+    if (!data) return NULL;
+    if (read_full(fd, data, length, wait_mask) == -1) {
+        free(data);
+        return NULL;
+    }
+    data[length] = '\0';
+    *len = length;
+    return data;
+}
+
+static int write_frame(int fd, int wide, const void *data, size_t len) {
+    if (wide) {
+        uint64_t length = len;
+        if (write_full(fd, &length, sizeof(length)) == -1) return -1;
+    } else {
+        uint32_t length = len;
+        if (write_full(fd, &length, sizeof(length)) == -1) return -1;
+    }
+    return write_full(fd, data, len);
+}
+
+// Runs one script for a client, capturing its output
+static void serve_request(FsContext *ctx, int conn, int home_fd, const sigset_t *wait_mask) {
+    size_t cwd_len, name_len, script_len;
+    char *cwd = read_frame(conn, 0, &cwd_len, wait_mask);
+    char *name = cwd ? read_frame(conn, 0, &name_len, wait_mask) : NULL;
+    char *script = name ? read_frame(conn, 1, &script_len, wait_mask) : NULL;
+
+    if (script) {
+        char *out_data = NULL, *err_data = NULL;
+        size_t out_len = 0, err_len = 0;
+        FILE *out = open_memstream(&out_data, &out_len);
+        FILE *err = open_memstream(&err_data, &err_len);
+        fs_set_output(ctx, out, err);
+
+        if (chdir(cwd) == -1) {
+            fprintf(err, "Error: Cannot change directory to %s\n", cwd);
+        } else {
+            fs_run_commands(ctx, script, script_len, name);
+        }
+        fs_reset(ctx);
+        if (fchdir(home_fd) == -1) {
+            fprintf(stderr, "Error: Cannot return to the daemon's directory\n");
+        }
+
+        fs_set_output(ctx, stdout, stderr);
+        fclose(out);
+        fclose(err);
+        if (write_frame(conn, 1, out_data, out_len) == 0) {
+            write_frame(conn, 1, err_data, err_len);
+        }
+        free(out_data);
+        free(err_data);
+    }
+    free(cwd);
+    free(name);
+    free(script);
+}
+
+// Serves requests on socket_path until SIGINT or SIGTERM
+static int run_daemon(FsContext *ctx, const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);  // Left behind by a previous daemon
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(sock, 64) == -1) {
+        fprintf(stderr, "Error: Cannot listen on %s\n", socket_path);
+        if (sock != -1) close(sock);
+        return -1;
+    }
+    int home_fd = open(".", O_RDONLY | O_DIRECTORY);
+
+    // Signals stay blocked except while waiting, so a shutdown request is
+    // never lost between the check and the wait
+    struct sigaction sa = {.sa_handler = daemon_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+    while (!daemon_stop) {
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+        if (ppoll(&pfd, 1, NULL, &wait_mask) <= 0) continue;
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1) continue;
+        struct timeval send_timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        serve_request(ctx, conn, home_fd, &wait_mask);
+        close(conn);
+    }
+
+    close(home_fd);
+    close(sock);
+    unlink(socket_path);
+    return 0;
+}
+
+// Sends the command file to a daemon and prints its output
+static int run_client(const char *socket_path, const char *cmd_path) {
+    char *commands;
+    size_t cmd_size;
+    int mapped;
+    if (load_command_file(cmd_path, &commands, &cmd_size, &mapped) == -1) {
+        fprintf(stderr, "Error: Cannot open command file %s\n", cmd_path);
+        return 1;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char cwd[PATH_MAX];
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int status = 1;
+    if (strlen(socket_path) >= sizeof(addr.sun_path) || !getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "Error: Cannot connect to %s\n", socket_path);
+        goto out;
+    }
+    strcpy(addr.sun_path, socket_path);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Error: Cannot connect to %s\n", socket_path);
+        goto out;
+    }
+
+    size_t out_len, err_len;
+    char *out_data = NULL, *err_data = NULL;
+    if (write_frame(sock, 0, cwd, strlen(cwd)) == -1 ||
+        write_frame(sock, 0, cmd_path, strlen(cmd_path)) == -1 ||
+        write_frame(sock, 1, commands, cmd_size) == -1 ||
+        !(out_data = read_frame(sock, 1, &out_len, NULL)) ||
+        !(err_data = read_frame(sock, 1, &err_len, NULL))) {
+        fprintf(stderr, "Error: Lost connection to %s\n", socket_path);
+    } else {
+        fwrite(out_data, 1, out_len, stdout);
+        fwrite(err_data, 1, err_len, stderr);
+        status = 0;
+    }
+    free(out_data);
+    free(err_data);
+
+out:
+    if (sock != -1) close(sock);
+    free_command_file(commands, cmd_size, mapped);
+    return status;
+}
+
+// Batch mode: many command files run on a thread pool, each in its own
+// context. Relative disk names resolve against the command file's
+// directory. Streams that name a common host file (a mounted image, its
+// journal, or a file I or X reads or writes) form a group that one worker
+// runs in input order, so results do not depend on scheduling. Each
+// stream's output is buffered and written in input order.
+typedef struct {
+    const char *path;
+    char *data;
+    size_t size;
+    int mapped;
+    int loaded;
+    int group;      // First stream of the group this stream belongs to
+    int next;       // Next stream in the same group, or -1
+    char *out_data;
+    char *err_data;
+    size_t out_len;
+    size_t err_len;
+    int done;
+} Stream;
+
+// A host file is identified by device and inode if it exists, else (it is
+// yet to be created, like most journals and X output) by those of its
+// directory and its name
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char *name;     // NULL when the file exists
+    int stream;
+} HostFileRef;
+
+typedef struct {
+    Stream *streams;
+    int count;
+    const Settings *settings;
+    FsContext *totals;      // Merged statistics of finished streams
+    int next_leader;        // Groups are claimed in order of their first stream
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
+
+typedef struct {
+    HostFileRef *refs;
+    int count;
+    int cap;
+    int dir_fd;
+    int stream;
+} HostFileScan;
+
+static int open_stream_dir(const char *path) {
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    return fd;
+}
+
+static void collect_host_file(const char *path, void *arg) {
+    HostFileScan *scan = arg;
+    struct stat st;
+    char *name = NULL;
+    if (fstatat(scan->dir_fd, path, &st, 0) == -1) {
+        const char *slash = strrchr(path, '/');
+        char dir[PATH_MAX];
+        if (!slash) {
+            strcpy(dir, ".");
+        } else {
+            size_t len = slash == path ? 1 : (size_t)(slash - path);  // "/name" is in /
+            memcpy(dir, path, len);
+            dir[len] = '\0';
+        }
+        if (fstatat(scan->dir_fd, dir, &st, 0) == -1) return;  // Cannot be created either
+        name = strdup(slash ? slash + 1 : path);
+    }
+    if (scan->count == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 64;
+        scan->refs = realloc(scan->refs, scan->cap * sizeof(HostFileRef));
+    }
+    scan->refs[scan->count++] = (HostFileRef){st.st_dev, st.st_ino, name, scan->stream};
+}
+
+static int same_host_file(const HostFileRef *x, const HostFileRef *y) {
+    if (x->dev != y->dev || x->ino != y->ino || !x->name != !y->name) return 0;
+    return !x->name || strcmp(x->name, y->name) == 0;
+}
+
+static int compare_host_file_ref(const void *a, const void *b) {
+    const HostFileRef *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    if (!x->name != !y->name) return x->name ? 1 : -1;
+    int names = x->name ? strcmp(x->name, y->name) : 0;
+    return names ? names : x->stream - y->stream;
+}
+
+static int find_group(Stream *streams, int i) {
+    while (streams[i].group != i) {
+        streams[i].group = streams[streams[i].group].group;
+        i = streams[i].group;
+    }
+    return i;
+}
+
+// Groups streams by the host files they name, then chains each group's
+// streams in input order
+static void group_streams(Stream *streams, int count) {
+    HostFileScan scan = {0};
+    for (int i = 0; i < count; i++) {
+        streams[i].group = i;
+        streams[i].next = -1;
+        if (!streams[i].loaded) continue;
+        scan.dir_fd = open_stream_dir(streams[i].path);
+        scan.stream = i;
+        fs_for_each_host_file(streams[i].data, streams[i].size, collect_host_file, &scan);
+        if (scan.dir_fd != -1) close(scan.dir_fd);
+    }
+
+    qsort(scan.refs, scan.count, sizeof(HostFileRef), compare_host_file_ref);
+    for (int i = 1; i < scan.count; i++) {
+        if (same_host_file(&scan.refs[i], &scan.refs[i - 1])) {
+            int a = find_group(streams, scan.refs[i - 1].stream);
+            int b = find_group(streams, scan.refs[i].stream);
+            if (a < b) streams[b].group = a;
+            if (b < a) streams[a].group = b;
+        }
+    }
+    for (int i = 0; i < scan.count; i++) free(scan.refs[i].name);
+    free(scan.refs);
+
+    int *tail = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int leader = find_group(streams, i);
+        if (leader != i) streams[tail[leader]].next = i;
+        tail[leader] = i;
+    }
+    for (int i = 0; i < count; i++) streams[i].group = find_group(streams, i);
+    free(tail);
+}
+
+static void run_stream(Batch *batch, Stream *stream) {
+    FILE *out = open_memstream(&stream->out_data, &stream->out_len);
+    FILE *err = open_memstream(&stream->err_data, &stream->err_len);
+    FsContext *ctx = new_context(batch->settings);
+    int dir_fd = -1;
+
+    if (!stream->loaded) {
+        fprintf(err, "Error: Cannot open command file %s\n", stream->path);
+    } else if ((dir_fd = open_stream_dir(stream->path)) == -1) {
+        fprintf(err, "Error: Cannot open the directory of %s\n", stream->path);
+    } else {
+        fs_set_output(ctx, out, err);
+        fs_set_directory(ctx, dir_fd);
+        fs_run_commands(ctx, stream->data, stream->size, stream->path);
+    }
+    fs_reset(ctx);
+    if (dir_fd != -1) close(dir_fd);
+    fclose(out);
+    fclose(err);
+
+    pthread_mutex_lock(&batch->lock);
+    fs_merge_stats(batch->totals, ctx);
+    stream->done = 1;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+    fs_context_free(ctx);
+}
+
+static void *batch_worker(void *arg) {
+    Batch *batch = arg;
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int leader = batch->next_leader;
+        while (leader < batch->count && batch->streams[leader].group != leader) leader++;
+        batch->next_leader = leader + 1;
+        pthread_mutex_unlock(&batch->lock);
+        if (leader >= batch->count) return NULL;
+
+        for (int i = leader; i != -1; i = batch->streams[i].next) {
+            run_stream(batch, &batch->streams[i]);
+        }
+    }
+}
+
+// Runs every command file with up to jobs workers; returns the number of
+// command files that could not be opened
+static int run_batch(char **paths, int count, int jobs, const Settings *settings,
+                     FsContext *totals) {
+    Stream *streams = calloc(count, sizeof(Stream));
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        streams[i].path = paths[i];
+        streams[i].loaded = load_command_file(paths[i], &streams[i].data, &streams[i].size,
+                                              &streams[i].mapped) == 0;
+        if (!streams[i].loaded) failed++;
+    }
+    group_streams(streams, count);
+
+    int groups = 0;
+    for (int i = 0; i < count; i++) groups += streams[i].group == i;
+    if (jobs > groups) jobs = groups;
+
+    Batch batch = {.streams = streams, .count = count, .settings = settings, .totals = totals};
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&workers[i], NULL, batch_worker, &batch);
+    }
+
+    // Write each stream's output as soon as it and every stream before it are done
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&batch.lock);
+        while (!streams[i].done) pthread_cond_wait(&batch.finished, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        fwrite(streams[i].out_data, 1, streams[i].out_len, stdout);
+        fflush(stdout);
+        fwrite(streams[i].err_data, 1, streams[i].err_len, stderr);
+        free(streams[i].out_data);
+        free(streams[i].err_data);
+        if (streams[i].loaded) free_command_file(streams[i].data, streams[i].size, streams[i].mapped);
+    }
+
+    for (int i = 0; i < jobs; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+    free(streams);
+    return failed;
+}
+
+// Command file paths from a manifest, one per line; blank lines and lines
+// starting with # are skipped
+static char **read_manifest(const char *path, int *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    char **paths = NULL;
+    int cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    *count = 0;
+    while ((n = getline(&line, &line_cap, f)) != -1) {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            paths = realloc(paths, cap * sizeof(char *));
+        }
+        paths[(*count)++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+    return paths ? paths : calloc(1, sizeof(char *));
+}
+
+static void write_stats(FsContext *ctx, const char *path) {
+    FILE *out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write stats to %s\n", path);
+        return;
+    }
+    fs_write_stats(ctx, out);
+    if (out != stderr) fclose(out);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s] [-S stats_file] [-f flush_interval] [-g flush_ms] [-J] [-p first|best|worst|next] "
+            "[-d defrag_blocks] [-H] [-A auto|uring|threads] [-k cache_blocks] <command_file>\n"
+            "       %s [options] [-j jobs] <command_file>... | -b manifest\n"
+            "       %s [options] -l socket\n"
+            "       %s -c socket <command_file>\n", prog, prog, prog, prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int show_stats = 0;
+    int jobs = 0;
+    const char *manifest = NULL;
+    const char *listen_path = NULL;
+    const char *connect_path = NULL;
+    const char *stats_path = getenv("FS_SIM_STATS");
+    Settings settings = {1, 0, 0, ALLOC_FIRST_FIT, 0, 0, 0, AIO_OFF, 0};
+    if (stats_path && !*stats_path) stats_path = NULL;
+    while ((opt = getopt(argc, argv, "sS:f:g:Jp:d:HA:k:l:c:j:b:")) != -1) {
+        switch (opt) {
+            case 'l':
+                listen_path = optarg;
+                break;
+            case 'c':
+                connect_path = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                manifest = optarg;
+                break;
+            case 's':
+                show_stats = 1;
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'f':
+                settings.flush_interval = atoi(optarg);
+                if (settings.flush_interval < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'g':
+                settings.flush_ms = atoi(optarg);
+                if (settings.flush_ms < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'J':
+                settings.journal = 1;
+                break;
+            case 'd':
+                settings.defrag_budget = atoi(optarg);
+                if (settings.defrag_budget < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'H':
+                settings.punch_holes = 1;
+                break;
+            case 'A':
+                if (strcmp(optarg, "auto") == 0) {
+                    settings.aio = AIO_AUTO;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    settings.aio = AIO_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    settings.aio = AIO_THREADS;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'k':
+                settings.block_cache = atoi(optarg);
+                if (settings.block_cache < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "first") == 0) {
+                    settings.alloc_policy = ALLOC_FIRST_FIT;
+                } else if (strcmp(optarg, "best") == 0) {
+                    settings.alloc_policy = ALLOC_BEST_FIT;
+                } else if (strcmp(optarg, "worst") == 0) {
+                    settings.alloc_policy = ALLOC_WORST_FIT;
+                } else if (strcmp(optarg, "next") == 0) {
+                    settings.alloc_policy = ALLOC_NEXT_FIT;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    settings.timing = stats_path != NULL;
+    int batch = manifest || jobs > 0 || argc - optind > 1;
+    int status = 0;
+    FsContext *ctx = new_context(&settings);
+
+    if (listen_path) {
+        if (connect_path || batch || optind != argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (run_daemon(ctx, listen_path) == -1) return 1;
+    } else if (batch) {
+        if (connect_path || (manifest && optind != argc) || (!manifest && optind == argc)) {
+            usage(argv[0]);
+            return 1;
+        }
+        int count = argc - optind;
+        char **paths = argv + optind;
+        if (manifest && !(paths = read_manifest(manifest, &count))) {
+            fprintf(stderr, "Error: Cannot open manifest %s\n", manifest);
+            return 1;
+        }
+        if (jobs == 0) jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        if (run_batch(paths, count, jobs, &settings, ctx) > 0) status = 1;
+        if (manifest) {
+            for (int i = 0; i < count; i++) free(paths[i]);
+            free(paths);
+        }
+    } else {
+        if (optind != argc - 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        char *cmd_path = argv[optind];
+        if (connect_path) return run_client(connect_path, cmd_path);
+
+        char *commands;
+        size_t cmd_size;
+        int mapped;
+        if (load_command_file(cmd_path, &commands, &cmd_size, &mapped) == -1) {
+            fprintf(stderr, "Error: Cannot open command file %s\n", cmd_path);
+            return 1;
+        }
+        fs_run_commands(ctx, commands, cmd_size, cmd_path);
+        free_command_file(commands, cmd_size, mapped);
+    }
+    fs_sync(ctx);
+    if (show_stats) {
+        fs_write_mount_cache_stats(ctx, stderr);
+        fs_write_block_cache_stats(ctx, stderr);
+    }
+    if (stats_path) {
+        write_stats(ctx, stats_path);
+    }
+    fs_context_free(ctx);
+    return status;
+}
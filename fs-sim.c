@@ -1,630 +1,2382 @@
+#define _GNU_SOURCE  // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  // From <linux/fs.h>; ours is below
+#endif
 #include "fs-sim.h"
 
 #define BLOCK_SIZE 1024
 #define NUM_BLOCKS 128
 #define NUM_INODES 126
+#define ROOT_INODE 127  // Parent index of root entries; the root itself has no inode
+
+#define INDEX_SLOTS 256
+#define MOUNT_CACHE_SLOTS 8
+#define MOUNT_TABLE_SLOTS 8
+#define DENTRY_SLOTS 64
+#define DENTRY_PATH_MAX 128     // Longer directory paths are resolved but not cached
+#define LATENCY_BUCKETS 40  // Bucket b holds latencies in [2^b, 2^(b+1)) ns
+#define AIO_DEPTH 64            // Writes queued before a batch must be waited for
+#define AIO_STAGING_BLOCKS (2 * NUM_BLOCKS)
+#define AIO_TRACKED_BLOCKS 512  // Writes past this are never queued
+#define AIO_WORKERS 4
+
+typedef struct AioQueue AioQueue;
+
+// A run of free blocks
+typedef struct {
+    int start;
+    int length;
+} Extent;
+
+// A directory path resolved from a base directory
+typedef struct {
+    unsigned long generation;    // Valid while it equals the context's namespace_generation
+    int base;
+    int dir_inode;
+    char path[DENTRY_PATH_MAX];  // NUL-terminated
+} Dentry;
+
+// A superblock this context has read and validated
+typedef struct {
+    int valid;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t checksum;      // CRC32C of raw
+    Superblock raw;         // Block 0 as read from disk
+    int consistency;        // check_consistency() result for raw
+    unsigned long last_used;
+} MountCacheEntry;
+
+// A mounted image M switched away from, with everything needed to make it
+// the active one again
+typedef struct {
+    int valid;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t size;                 // Identity when parked
+    struct timespec mtime;
+    Superblock superblock;
+    Superblock disk_superblock;
+    uint64_t index_keys[INDEX_SLOTS];
+    uint8_t index_inodes[INDEX_SLOTS];
+    int index_has_duplicates;
+    uint64_t used_inodes[2];
+    uint64_t children[128][2];
+    Extent free_extents[NUM_BLOCKS / 2];
+    int num_free_extents;
+    int free_extents_valid;
+    unsigned long last_used;
+} ParkedMount;
+
+// A block cache slot; slots are recycled by CLOCK
+typedef struct {
+    int block;       // -1 when free
+    int referenced;  // Set on every hit, cleared as the hand passes
+} BlockCacheSlot;
+
+typedef struct {
+    unsigned long count;
+    uint64_t total_ns;
+    unsigned long histogram[LATENCY_BUCKETS];
+} CommandStats;
+
+typedef struct {
+    unsigned long opens;
+    unsigned long preads;
+    unsigned long pwrites;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    unsigned long superblock_writes;
+    unsigned long hole_punches;
+    uint64_t bytes_punched;
+    unsigned long journal_commits;
+    uint64_t journal_bytes;
+    unsigned long journal_replays;   // Records applied at mount
+    unsigned long fsyncs;
+    unsigned long aio_batches;       // Waits that completed queued writes
+    unsigned long aio_writes;
+} IoStats;
+
+// Write-ahead journal record: a header, count block numbers, then the
+// count blocks. A record is complete when its checksum matches. A revoke
+// record has only the block numbers: those blocks were written in place
+// since, so replay skips the copies earlier records hold.
+#define JOURNAL_MAGIC 0x4c4e524aU          // "JRNL"
+#define JOURNAL_REVOKE_MAGIC 0x4b4f5652U   // "RVOK"
+#define JOURNAL_CHECKPOINT_BLOCKS 256
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t checksum;  // CRC32C of the block numbers and blocks
+    uint32_t reserved;
+} JournalRecord;
+
+// Blocks written together with the superblock in one transaction
+typedef struct {
+    int block;
+    int count;
+    const void *data;
+} JournalExtent;
+
+// Everything a simulator instance owns. Contexts share nothing but the
+// read-only CRC32C table, so each one can mount its own disk.
+struct FsContext {
+    Superblock superblock;
+    char buffer[NUM_BLOCKS * BLOCK_SIZE];  // Block 0 is R/W/B's buffer; G and P use a range
+    int buffer_blocks;          // Blocks of buffer that may be nonzero
+    char *current_disk;
+    int current_dir_inode;      // Current directory inode index, ROOT_INODE at the root
+    int disk_fd;                // Mounted disk, kept open until remount or free
+    int dir_fd;                 // Relative disk names resolve here
+
+    // Streams for command output and errors
+    FILE *out;
+    FILE *err;
+
+    // Write-back superblock cache: mutations only mark the superblock dirty,
+    // and block 0 is rewritten at flush points (every flush_interval
+    // commands, on remount and on sync) if it differs from the copy last
+    // seen on disk.
+    Superblock disk_superblock;  // Block 0 as last read from or written to disk
+    int superblock_dirty;
+    int flush_interval;          // 0 = flush only on remount and sync
+    int commands_since_flush;
+    int flush_ms;                // Also flush once a change is this many ms old (0 = off)
+    uint64_t dirty_since_ns;
+
+    // Write-ahead journal: with it on, every superblock write (and the data
+    // moves of defragmentation) is first appended to <disk>.journal as one
+    // record and made durable with fdatasync, and only then written in
+    // place. The journal is checkpointed (disk synced, journal emptied) when
+    // it grows past JOURNAL_CHECKPOINT_BLOCKS and removed when the disk is
+    // unmounted. Mount replays whatever complete records a crash left. A
+    // block in a record that is later written in place outside a
+    // transaction (W, P, I, zeroing) is revoked first. If the journal cannot
+    // be written, that is reported once and the disk is written without one
+    // until the next mount.
+    int journal;
+    int journal_stopped;         // The journal could not be written; off until the next mount
+    int journal_fd;              // -1 until the first commit after a mount
+    char *journal_path;          // Relative to dir_fd, like the disk name
+    off_t journal_size;
+    uint64_t journal_live[NUM_BLOCKS / 64];  // Blocks replay would write: in a record, not revoked
+    int journal_committing;      // Writing a record's blocks in place; they need no revoke
+
+    // Name index: open-addressing hash table (linear probing) mapping a
+    // (parent inode, 5-byte name) key to the in-use inode holding it. It is
+    // rebuilt whenever the superblock is loaded and kept current by create
+    // and delete; nothing else changes names or parents.
+    uint64_t index_keys[INDEX_SLOTS];   // 0 marks an empty slot
+    uint8_t index_inodes[INDEX_SLOTS];
+    int index_has_duplicates;           // Only possible on an inconsistent superblock
+    uint64_t used_inodes[2];            // Bit i set when inode i is in use
+
+    // Directory adjacency: bit i of children[p] is set when in-use inode i
+    // has parent index p. Walking set bits visits entries in inode order,
+    // and the popcount is the directory's entry count.
+    uint64_t children[128][2];
+
+    // Dentry cache: the directory parts of path arguments, keyed by the
+    // directory they start from, mapped to the directory they name. Every
+    // change to the name index (create, delete, loading a superblock) bumps
+    // namespace_generation, which invalidates all entries at once.
+    // Defragmentation and resizing move blocks, never inodes, so entries
+    // survive them.
+    Dentry dentry_cache[DENTRY_SLOTS];
+    unsigned long namespace_generation;
+    unsigned long dentry_hits;
+    unsigned long dentry_misses;
+
+    // Free-extent index: maximal runs of free blocks (1..127) in start
+    // order, derived from free_block_list. It is rebuilt on mount and lazily
+    // after any change to the bitmap, so it always matches the on-disk
+    // bitmap bit for bit.
+    Extent free_extents[NUM_BLOCKS / 2];
+    int num_free_extents;
+    int free_extents_valid;
+
+    // Placement policy for new files and relocated (resized) files
+    AllocPolicy alloc_policy;
+    int next_fit_block;          // Next-fit resumes searching here
+
+    // Incremental defragmentation: after each command, up to defrag_budget
+    // blocks' worth of files slide down into the first hole. Unused budget
+    // is banked while the disk stays fragmented so large files eventually
+    // move.
+    int defrag_budget;           // 0 = off
+    int defrag_credit;
+
+    int punch_holes;             // Free blocks with fallocate instead of writing zeros
+
+    // Asynchronous writes: when set, block writes are queued and completed
+    // together (see aio_wait), at the latest once per command
+    AioQueue *aio;
+
+    // Block cache: copies of blocks of the active image that R has read,
+    // in block_cache_size slots replaced by CLOCK. It is write-through:
+    // every write to the active image updates cached copies and a punched
+    // range is dropped, so a hit is always current. It is emptied when
+    // another image becomes active. A miss on the block after the one R
+    // read last from the same file also reads ahead through the rest of the
+    // file's extent (up to half the cache) with the same pread.
+    int block_cache_size;              // 0 = off
+    BlockCacheSlot *block_cache;
+    char *block_cache_data;            // block_cache_size blocks, then a read-ahead area
+    int block_cache_slot[NUM_BLOCKS];  // Slot holding each block, -1 if none
+    int block_cache_hand;
+    int last_read_inode;               // Last R, for spotting sequential reads
+    int last_read_block;
+    unsigned long block_cache_hits;
+    unsigned long block_cache_misses;
+    unsigned long block_cache_readahead;  // Blocks read before R asked for them
+
+    // Mount cache: raw superblocks this context has read and validated,
+    // keyed by the image's device, inode, size and modification time. A
+    // remount of an unchanged image skips both the read and the consistency
+    // check; a changed image whose block 0 still matches a cached CRC32C and
+    // contents skips the check. Assumes no other process rewrites mounted
+    // images.
+    MountCacheEntry mount_cache[MOUNT_CACHE_SLOTS];
+    unsigned long mount_cache_clock;
+    unsigned long mount_cache_hits;           // Read and check skipped
+    unsigned long mount_cache_checksum_hits;  // Check skipped
+    unsigned long mount_cache_misses;
+    dev_t current_dev;           // Identity of the mounted image
+    ino_t current_ino;
+
+    // Mount table: images this context switched away from, parked with
+    // their open descriptor, superblock and indexes. M of a parked image
+    // that is unchanged on disk swaps it back in without reopening,
+    // rereading or revalidating it. The active image is never parked.
+    ParkedMount mount_table[MOUNT_TABLE_SLOTS];
+    unsigned long mount_table_clock;
+    unsigned long mount_table_switches;
+    int active_consistent;       // The active superblock passed the check since it last changed
+
+    // Instrumentation. I/O counters are always kept, since they cost one
+    // increment per system call; per-command latencies are only measured
+    // when timing is enabled.
+    int timing;
+    CommandStats command_stats[128];  // Indexed by opcode
+    unsigned long command_errors;
+    IoStats io_stats;
+};
+
+FsContext *fs_context_new(void) {
+    FsContext *ctx = calloc(1, sizeof(FsContext));
+    if (!ctx) return NULL;
+    ctx->disk_fd = -1;
+    ctx->journal_fd = -1;
+    ctx->dir_fd = AT_FDCWD;
+    ctx->current_dir_inode = ROOT_INODE;
+    ctx->out = stdout;
+    ctx->err = stderr;
+    ctx->flush_interval = 1;
+    ctx->alloc_policy = ALLOC_FIRST_FIT;
+    ctx->next_fit_block = 1;
+    ctx->last_read_inode = -1;
+    ctx->namespace_generation = 1;  // Zeroed dentries never match
+    return ctx;
+}
+
+void fs_set_output(FsContext *ctx, FILE *out, FILE *err) {
+    ctx->out = out;
+    ctx->err = err;
+}
+
+void fs_set_directory(FsContext *ctx, int dir_fd) {
+    ctx->dir_fd = dir_fd;
+}
+
+void fs_set_flush_interval(FsContext *ctx, int commands) {
+    ctx->flush_interval = commands;
+}
+
+void fs_set_flush_ms(FsContext *ctx, int ms) {
+    ctx->flush_ms = ms;
+}
+
+void fs_set_journal(FsContext *ctx, int enabled) {
+    ctx->journal = enabled;
+}
+
+void fs_set_alloc_policy(FsContext *ctx, AllocPolicy policy) {
+    ctx->alloc_policy = policy;
+}
+
+void fs_set_defrag_budget(FsContext *ctx, int blocks) {
+    ctx->defrag_budget = blocks;
+}
+
+void fs_set_timing(FsContext *ctx, int enabled) {
+    ctx->timing = enabled;
+}
+
+void fs_set_hole_punching(FsContext *ctx, int enabled) {
+    ctx->punch_holes = enabled;
+}
+
+static void mount_cache_block0_written(FsContext *ctx);
+static void journal_revoke(FsContext *ctx, int fd, int block_num, int count);
+static uint32_t crc32c(const void *data, size_t len);
+static uint64_t now_ns(void);
+
+// Asynchronous writes. Block writes are queued with a private copy of
+// their data, so callers may reuse buffers at once, and aio_wait submits
+// the whole queue and waits for it: through io_uring (raw system calls, one
+// io_uring_enter per batch) where the kernel allows it, otherwise through a
+// small pool of threads issuing pwrite. Queued writes never overlap: a write
+// touching a block that already has one queued waits for the batch first,
+// and so does every read, fallocate and fsync, so the disk always sees the
+// same sequence of contents as with synchronous writes.
+typedef struct {
+    int fd;
+    const void *data;
+    size_t len;
+    off_t offset;
+} AioWrite;
+
+struct AioQueue {
+    AioEngine engine;            // AIO_URING or AIO_THREADS
+    AioWrite writes[AIO_DEPTH];
+    int count;
+    char *staging;               // Copies of the queued data
+    int staging_used;            // In blocks
+    uint64_t pending[AIO_TRACKED_BLOCKS / 64];  // Blocks with a queued write
+
+#ifdef __NR_io_uring_setup
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+
+    // Thread pool: workers claim writes[next] until batch_size are taken
+    pthread_t threads[AIO_WORKERS];
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int next;
+    int completed;
+    int batch_size;
+    int shutdown;
+};
+
+static void write_fully(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+#ifdef __NR_io_uring_setup
+static int aio_uring_setup(AioQueue *q) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+    if (fd < 0) return 0;  // No kernel support, or disabled
+
+    q->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    q->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    q->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_CQ_RING);
+    q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED || q->sqes == MAP_FAILED) {
+        if (q->sq_ring != MAP_FAILED) munmap(q->sq_ring, q->sq_ring_size);
+        if (q->cq_ring != MAP_FAILED) munmap(q->cq_ring, q->cq_ring_size);
+        if (q->sqes != MAP_FAILED) munmap(q->sqes, q->sqes_size);
+        close(fd);
+        return 0;
+    }
+
+    q->ring_fd = fd;
+    q->sq_head = (unsigned *)((char *)q->sq_ring + params.sq_off.head);
+    q->sq_tail = (unsigned *)((char *)q->sq_ring + params.sq_off.tail);
+    q->sq_mask = (unsigned *)((char *)q->sq_ring + params.sq_off.ring_mask);
+    q->sq_array = (unsigned *)((char *)q->sq_ring + params.sq_off.array);
+    q->cq_head = (unsigned *)((char *)q->cq_ring + params.cq_off.head);
+    q->cq_tail = (unsigned *)((char *)q->cq_ring + params.cq_off.tail);
+    q->cq_mask = (unsigned *)((char *)q->cq_ring + params.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)((char *)q->cq_ring + params.cq_off.cqes);
+    return 1;
+}
+
+// Gives up on a ring io_uring_enter failed on. The in_flight writes it
+// already took are waited for (their completions discarded) before the ring
+// is closed, so none can land after a later write or read the staging area
+// once it is reused. If even waiting fails, the old staging area is left to
+// the kernel and a new one allocated. The queue writes synchronously from
+// then on.
+static void aio_uring_close(AioQueue *q, int in_flight) {
+    while (in_flight > 0) {
+        int ret = syscall(__NR_io_uring_enter, q->ring_fd, 0, in_flight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+        unsigned head = *q->cq_head;
+        unsigned cq_tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++) in_flight--;
+        __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (in_flight > 0) {
+        char *staging = malloc((size_t)AIO_STAGING_BLOCKS * BLOCK_SIZE);
+        if (staging) q->staging = staging;
+    }
+
+    munmap(q->sq_ring, q->sq_ring_size);
+    munmap(q->cq_ring, q->cq_ring_size);
+    munmap(q->sqes, q->sqes_size);
+    close(q->ring_fd);
+    q->engine = AIO_THREADS;  // With no threads: synchronous
+}
+
+// Submits the queue and reaps every completion. A write the kernel rejects
+// or cuts short (e.g. IORING_OP_WRITE on a kernel older than 5.6) is redone
+// with pwrite; rewriting the same data is harmless.
+static void aio_uring_run(AioQueue *q) {
+    unsigned first = *q->sq_tail;
+    unsigned tail = first;
+    for (int i = 0; i < q->count; i++) {
+        unsigned idx = tail & *q->sq_mask;
+        struct io_uring_sqe *sqe = &q->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = q->writes[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)q->writes[i].data;
+        sqe->len = q->writes[i].len;
+        sqe->off = q->writes[i].offset;
+        sqe->user_data = i;
+        q->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = q->count;
+    int reaped = 0;
+    while (reaped < q->count) {
+        int ret = syscall(__NR_io_uring_enter, q->ring_fd, to_submit, q->count - reaped,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            // The ring is unusable; finish the batch synchronously once the
+            // writes the kernel took are done (its head says how many)
+            aio_uring_close(q, (int)(__atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE) - first) - reaped);
+            for (int i = 0; i < q->count; i++) {
+                write_fully(q->writes[i].fd, q->writes[i].data, q->writes[i].len, q->writes[i].offset);
+            }
+            return;
+        }
+        if (ret > 0) to_submit -= ret < (int)to_submit ? (unsigned)ret : to_submit;
+
+        unsigned head = *q->cq_head;
+        unsigned cq_tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, reaped++) {
+            struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+            const AioWrite *w = &q->writes[cqe->user_data];
+            if (cqe->res < 0 || (size_t)cqe->res < w->len) write_fully(w->fd, w->data, w->len, w->offset);
+        }
+        __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+static void *aio_worker(void *arg) {
+    AioQueue *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->shutdown && q->next >= q->batch_size) pthread_cond_wait(&q->work, &q->lock);
+        if (q->shutdown) break;
+        AioWrite w = q->writes[q->next++];
+        pthread_mutex_unlock(&q->lock);
+        write_fully(w.fd, w.data, w.len, w.offset);
+        pthread_mutex_lock(&q->lock);
+        if (++q->completed == q->batch_size) pthread_cond_signal(&q->done);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void aio_threads_run(AioQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->next = 0;
+    q->completed = 0;
+    q->batch_size = q->count;
+    pthread_cond_broadcast(&q->work);
+    while (q->completed < q->batch_size) pthread_cond_wait(&q->done, &q->lock);
+    q->next = q->batch_size = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Completes every queued write
+static void aio_wait(FsContext *ctx) {
+    AioQueue *q = ctx->aio;
+    if (!q || q->count == 0) return;
+#ifdef __NR_io_uring_setup
+    if (q->engine == AIO_URING) aio_uring_run(q);
+    else
+#endif
+    if (q->num_threads > 0) aio_threads_run(q);
+    else {
+        for (int i = 0; i < q->count; i++) {
+            write_fully(q->writes[i].fd, q->writes[i].data, q->writes[i].len, q->writes[i].offset);
+        }
+    }
+    ctx->io_stats.aio_batches++;
+    ctx->io_stats.aio_writes += q->count;
+    q->count = 0;
+    q->staging_used = 0;
+    memset(q->pending, 0, sizeof(q->pending));
+}
+
+static int aio_overlaps(const AioQueue *q, int from, int to) {
+    for (int b = from; b < to; b++) {
+        if (q->pending[b / 64] >> (b % 64) & 1) return 1;
+    }
+    return 0;
+}
 
-// Global variables
-static Superblock superblock;
-static char buffer[BLOCK_SIZE];
-static char *current_disk;
-static int current_dir_inode = 0;  // Root directory inode index
+// Queues a write of count blocks; returns 0 if it must be done synchronously
+static int aio_queue_write(FsContext *ctx, int fd, int block_num, int count, const void *data) {
+    AioQueue *q = ctx->aio;
+    if (block_num < 0 || block_num + count > AIO_TRACKED_BLOCKS || count > AIO_STAGING_BLOCKS) {
+        aio_wait(ctx);
+        return 0;
+    }
+    if (q->count == AIO_DEPTH || q->staging_used + count > AIO_STAGING_BLOCKS ||
+        aio_overlaps(q, block_num, block_num + count)) {
+        aio_wait(ctx);
+    }
+
+    char *copy = q->staging + (size_t)q->staging_used * BLOCK_SIZE;
+    memcpy(copy, data, (size_t)count * BLOCK_SIZE);
+    q->staging_used += count;
+    q->writes[q->count++] = (AioWrite){fd, copy, (size_t)count * BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE};
+    for (int b = block_num; b < block_num + count; b++) q->pending[b / 64] |= 1ULL << (b % 64);
+    return 1;
+}
+
+static void aio_free(AioQueue *q) {
+    if (!q) return;
+    if (q->num_threads > 0) {
+        pthread_mutex_lock(&q->lock);
+        q->shutdown = 1;
+        pthread_cond_broadcast(&q->work);
+        pthread_mutex_unlock(&q->lock);
+        for (int i = 0; i < q->num_threads; i++) pthread_join(q->threads[i], NULL);
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->work);
+        pthread_cond_destroy(&q->done);
+    }
+#ifdef __NR_io_uring_setup
+    if (q->engine == AIO_URING) {
+        munmap(q->sq_ring, q->sq_ring_size);
+        munmap(q->cq_ring, q->cq_ring_size);
+        munmap(q->sqes, q->sqes_size);
+        close(q->ring_fd);
+    }
+#endif
+    free(q->staging);
+    free(q);
+}
+
+static AioQueue *aio_new(AioEngine engine) {
+    AioQueue *q = calloc(1, sizeof(AioQueue));
+    if (!q) return NULL;
+    q->staging = malloc((size_t)AIO_STAGING_BLOCKS * BLOCK_SIZE);
+    if (!q->staging) {
+        free(q);
+        return NULL;
+    }
+#ifdef __NR_io_uring_setup
+    if (engine != AIO_THREADS && aio_uring_setup(q)) {
+        q->engine = AIO_URING;
+        return q;
+    }
+#endif
+    q->engine = AIO_THREADS;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+    while (q->num_threads < AIO_WORKERS &&
+           pthread_create(&q->threads[q->num_threads], NULL, aio_worker, q) == 0) {
+        q->num_threads++;
+    }
+    return q;  // With no threads at all, aio_wait writes synchronously
+}
+
+void fs_set_async_io(FsContext *ctx, AioEngine engine) {
+    aio_wait(ctx);
+    aio_free(ctx->aio);
+    ctx->aio = engine == AIO_OFF ? NULL : aio_new(engine);
+}
+
+static void block_cache_clear(FsContext *ctx) {
+    for (int i = 0; i < ctx->block_cache_size; i++) ctx->block_cache[i].block = -1;
+    for (int b = 0; b < NUM_BLOCKS; b++) ctx->block_cache_slot[b] = -1;
+    ctx->block_cache_hand = 0;
+    ctx->last_read_inode = -1;
+}
+
+void fs_set_block_cache(FsContext *ctx, int blocks) {
+    if (blocks > NUM_BLOCKS) blocks = NUM_BLOCKS;  // A disk has no more
+    free(ctx->block_cache);
+    free(ctx->block_cache_data);
+    ctx->block_cache = NULL;
+    ctx->block_cache_data = NULL;
+    ctx->block_cache_size = 0;
+    if (blocks > 0) {
+        int readahead = blocks / 2 > 1 ? blocks / 2 : 1;
+        ctx->block_cache = malloc(blocks * sizeof(BlockCacheSlot));
+        ctx->block_cache_data = malloc((size_t)(blocks + readahead) * BLOCK_SIZE);
+        if (ctx->block_cache && ctx->block_cache_data) {
+            ctx->block_cache_size = blocks;
+        } else {
+            free(ctx->block_cache);
+            free(ctx->block_cache_data);
+            ctx->block_cache = NULL;
+            ctx->block_cache_data = NULL;
+        }
+    }
+    block_cache_clear(ctx);
+}
+
+// Caches a block read from the active image, evicting the first slot the
+// CLOCK hand finds unreferenced
+static void block_cache_insert(FsContext *ctx, int block_num, const char *data, int referenced) {
+    int slot = ctx->block_cache_slot[block_num];
+    if (slot == -1) {
+        for (;;) {
+            slot = ctx->block_cache_hand;
+            ctx->block_cache_hand = (slot + 1) % ctx->block_cache_size;
+            BlockCacheSlot *victim = &ctx->block_cache[slot];
+            if (victim->block == -1 || !victim->referenced) break;
+            victim->referenced = 0;
+        }
+        if (ctx->block_cache[slot].block != -1) ctx->block_cache_slot[ctx->block_cache[slot].block] = -1;
+        ctx->block_cache[slot].block = block_num;
+        ctx->block_cache_slot[block_num] = slot;
+    }
+    ctx->block_cache[slot].referenced = referenced;
+    memcpy(ctx->block_cache_data + (size_t)slot * BLOCK_SIZE, data, BLOCK_SIZE);
+}
+
+// Keeps cached copies current when blocks of the active image are written;
+// data NULL drops them instead (punched blocks)
+static void block_cache_update(FsContext *ctx, int fd, int block_num, int count, const char *data) {
+    if (!ctx->block_cache_size || fd != ctx->disk_fd) return;
+    for (int i = 0; i < count && block_num + i < NUM_BLOCKS; i++) {
+        int slot = ctx->block_cache_slot[block_num + i];
+        if (slot == -1) continue;
+        if (data) {
+            memcpy(ctx->block_cache_data + (size_t)slot * BLOCK_SIZE, data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        } else {
+            ctx->block_cache[slot].block = -1;
+            ctx->block_cache_slot[block_num + i] = -1;
+        }
+    }
+}
 
 // Helper functions
-static void write_block(FILE *disk, int block_num, const void *data) {
-    fseek(disk, block_num * BLOCK_SIZE, SEEK_SET);
-    fwrite(data, BLOCK_SIZE, 1, disk);
+static void write_block(FsContext *ctx, int fd, int block_num, const void *data) {
+    journal_revoke(ctx, fd, block_num, 1);
+    ctx->io_stats.pwrites++;
+    ctx->io_stats.bytes_written += BLOCK_SIZE;
+    block_cache_update(ctx, fd, block_num, 1, data);
+    if (ctx->aio && aio_queue_write(ctx, fd, block_num, 1, data)) return;
+    pwrite(fd, data, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
 }
 
-static void read_block(FILE *disk, int block_num, void *data) {
-    fseek(disk, block_num * BLOCK_SIZE, SEEK_SET);
-    fread(data, BLOCK_SIZE, 1, disk);
+static void read_block(FsContext *ctx, int fd, int block_num, void *data) {
+    ctx->io_stats.preads++;
+    ctx->io_stats.bytes_read += BLOCK_SIZE;
+    aio_wait(ctx);
+    pread(fd, data, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
 }
 
-static int find_free_inode(void) {
+// Multi-block transfers of contiguous blocks in a single call
+static void write_blocks(FsContext *ctx, int fd, int block_num, int count, const void *data) {
+    journal_revoke(ctx, fd, block_num, count);
+    ctx->io_stats.pwrites++;
+    ctx->io_stats.bytes_written += (uint64_t)count * BLOCK_SIZE;
+    block_cache_update(ctx, fd, block_num, count, data);
+    if (ctx->aio && aio_queue_write(ctx, fd, block_num, count, data)) return;
+    pwrite(fd, data, (size_t)count * BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+}
+
+static ssize_t read_blocks(FsContext *ctx, int fd, int block_num, int count, void *data) {
+    ctx->io_stats.preads++;
+    ctx->io_stats.bytes_read += (uint64_t)count * BLOCK_SIZE;
+    aio_wait(ctx);
+    return pread(fd, data, (size_t)count * BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+}
+
+// Zeros count contiguous blocks. With hole punching, the range is released
+// with one fallocate call, which reads back as zeros; if the host file
+// system cannot punch holes, zeros are written instead. Blocks past the end
+// of the disk (which only a corrupt inode reaches) are always written, since
+// that grows the image and a punched hole would not.
+static void zero_blocks(FsContext *ctx, int fd, int block_num, int count) {
+    static const char zeros[NUM_BLOCKS * BLOCK_SIZE];
+    if (count <= 0) return;
+    journal_revoke(ctx, fd, block_num, count);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    int inside = block_num >= NUM_BLOCKS ? 0 : block_num + count > NUM_BLOCKS ? NUM_BLOCKS - block_num : count;
+    if (ctx->punch_holes && inside > 0) {
+        aio_wait(ctx);  // Queued writes to these blocks must land first
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      (off_t)block_num * BLOCK_SIZE, (off_t)inside * BLOCK_SIZE) == 0) {
+            ctx->io_stats.hole_punches++;
+            ctx->io_stats.bytes_punched += (uint64_t)inside * BLOCK_SIZE;
+            block_cache_update(ctx, fd, block_num, inside, NULL);
+            block_num += inside;
+            count -= inside;
+            if (count == 0) return;
+        } else if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            ctx->punch_holes = 0;  // Don't retry on this host file system
+        }
+    }
+#endif
+    for (int done = 0; done < count; done += NUM_BLOCKS) {
+        int n = count - done < NUM_BLOCKS ? count - done : NUM_BLOCKS;
+        write_blocks(ctx, fd, block_num + done, n, zeros);
+    }
+}
+
+static int block_is_zero(const char *data) {
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (data[i]) return 0;
+    }
+    return 1;
+}
+
+static void clear_buffer(FsContext *ctx) {
+    memset(ctx->buffer, 0, (size_t)(ctx->buffer_blocks > 1 ? ctx->buffer_blocks : 1) * BLOCK_SIZE);
+    ctx->buffer_blocks = 1;
+}
+
+static void mark_superblock_dirty(FsContext *ctx) {
+    if (ctx->flush_ms > 0 && !ctx->superblock_dirty) ctx->dirty_since_ns = now_ns();
+    ctx->superblock_dirty = 1;
+    ctx->active_consistent = 0;
+}
+
+static void sync_fd(FsContext *ctx, int fd) {
+    aio_wait(ctx);
+    ctx->io_stats.fsyncs++;
+    fdatasync(fd);
+}
+
+static int block_set_has(const uint64_t *set, uint32_t block) {
+    return set[block / 64] >> (block % 64) & 1;
+}
+
+// Appends a record built by the caller (header left for this to fill in)
+// and makes it durable, creating the journal on the first one. Returns 0 if
+// the journal cannot be written, in which case nothing was committed.
+static int journal_write(FsContext *ctx, char *record, uint32_t magic, uint32_t count, size_t size) {
+    if (ctx->journal_fd == -1) {
+        size_t len = strlen(ctx->current_disk) + sizeof(".journal");
+        ctx->journal_path = malloc(len);
+        snprintf(ctx->journal_path, len, "%s.journal", ctx->current_disk);
+        ctx->journal_fd = openat(ctx->dir_fd, ctx->journal_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ctx->io_stats.opens++;
+        ctx->journal_size = 0;
+        if (ctx->journal_fd == -1) {
+            fprintf(ctx->err, "Error: Cannot create journal %s\n", ctx->journal_path);
+            free(ctx->journal_path);
+            ctx->journal_path = NULL;
+            return 0;
+        }
+    }
+
+    JournalRecord header = {magic, count, crc32c(record + sizeof(JournalRecord), size - sizeof(JournalRecord)), 0};
+    memcpy(record, &header, sizeof(header));
+    if (pwrite(ctx->journal_fd, record, size, ctx->journal_size) != (ssize_t)size) {
+        fprintf(ctx->err, "Error: Cannot write journal %s\n", ctx->journal_path);
+        return 0;
+    }
+    sync_fd(ctx, ctx->journal_fd);
+    ctx->journal_size += size;
+    ctx->io_stats.journal_bytes += size;
+    return 1;
+}
+
+// Appends one record holding the given blocks and makes it durable. Returns
+// 0 if the journal cannot be written, in which case nothing was committed.
+static int journal_append(FsContext *ctx, const JournalExtent *extents, int num_extents) {
+    int count = 0;
+    for (int i = 0; i < num_extents; i++) count += extents[i].count;
+    size_t list_size = (size_t)count * sizeof(uint32_t);
+    size_t size = sizeof(JournalRecord) + list_size + (size_t)count * BLOCK_SIZE;
+    char *record = malloc(size);
+    uint32_t *blocks = (uint32_t *)(record + sizeof(JournalRecord));
+    char *data = record + sizeof(JournalRecord) + list_size;
+    for (int i = 0, n = 0; i < num_extents; i++) {
+        for (int j = 0; j < extents[i].count; j++, n++) blocks[n] = extents[i].block + j;
+        memcpy(data, extents[i].data, (size_t)extents[i].count * BLOCK_SIZE);
+        data += (size_t)extents[i].count * BLOCK_SIZE;
+    }
+
+    int written = journal_write(ctx, record, JOURNAL_MAGIC, count, size);
+    if (written) {
+        for (int i = 0; i < count; i++) ctx->journal_live[blocks[i] / 64] |= 1ULL << (blocks[i] % 64);
+        ctx->io_stats.journal_commits++;
+    }
+    free(record);
+    return written;
+}
+
+// Makes the in-place writes durable so the journal can start over; with
+// remove set, also deletes the journal (the disk is being unmounted)
+static void journal_checkpoint(FsContext *ctx, int remove) {
+    if (remove) ctx->journal_stopped = 0;  // The next disk gets a journal again
+    if (ctx->journal_fd == -1) return;
+    sync_fd(ctx, ctx->disk_fd);
+    if (!remove) {
+        // Synced, so a crash cannot bring back a tail of the old records
+        // behind the new ones
+        if (ftruncate(ctx->journal_fd, 0) == 0) {
+            sync_fd(ctx, ctx->journal_fd);
+            ctx->journal_size = 0;
+            memset(ctx->journal_live, 0, sizeof(ctx->journal_live));
+        }
+        return;
+    }
+    close(ctx->journal_fd);
+    unlinkat(ctx->dir_fd, ctx->journal_path, 0);
+    free(ctx->journal_path);
+    ctx->journal_fd = -1;
+    ctx->journal_path = NULL;
+    memset(ctx->journal_live, 0, sizeof(ctx->journal_live));
+}
+
+// Turns the journal off until the next mount once it cannot be written,
+// after the one error journal_append reported. The disk is synced and the
+// journal removed first, so no record is left to be replayed over the
+// unjournaled writes that follow.
+static void journal_stop(FsContext *ctx) {
+    journal_checkpoint(ctx, 1);
+    ctx->journal_stopped = 1;
+}
+
+// Called before blocks are written outside a transaction. Records that
+// still hold older copies of any of them (defragmentation moves) would
+// write those over the new data on replay, so a revoke record for them is
+// made durable first.
+static void journal_revoke(FsContext *ctx, int fd, int block_num, int count) {
+    if (fd != ctx->disk_fd || ctx->journal_committing || !(ctx->journal_live[0] | ctx->journal_live[1])) return;
+    uint32_t revoked[NUM_BLOCKS];
+    uint32_t n = 0;
+    for (int b = block_num < 0 ? 0 : block_num; b < block_num + count && b < NUM_BLOCKS; b++) {
+        if (block_set_has(ctx->journal_live, b)) revoked[n++] = b;
+    }
+    if (n == 0) return;
+
+    size_t size = sizeof(JournalRecord) + n * sizeof(uint32_t);
+    char *record = malloc(size);
+    memcpy(record + sizeof(JournalRecord), revoked, n * sizeof(uint32_t));
+    int written = journal_write(ctx, record, JOURNAL_REVOKE_MAGIC, n, size);
+    free(record);
+    if (!written) {
+        journal_stop(ctx);
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++) ctx->journal_live[revoked[i] / 64] &= ~(1ULL << (revoked[i] % 64));
+}
+
+// Applies the complete records of a journal a crash left behind to the
+// disk about to be mounted, then removes it. Records are checked oldest
+// first up to the first torn one, then applied newest first: each block
+// gets the copy in the last record naming it, unless a revoke came later.
+static void journal_replay(FsContext *ctx, int fd, const char *disk_name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.journal", disk_name);
+    int journal_fd = openat(ctx->dir_fd, path, O_RDONLY);
+    if (journal_fd == -1) return;
+    ctx->io_stats.opens++;
+
+    struct stat st;
+    char *journal = NULL;
+    off_t size = fstat(journal_fd, &st) == 0 ? st.st_size : 0;
+    if (size > 0) {
+        journal = malloc(size);
+        if (pread(journal_fd, journal, size, 0) != size) size = 0;
+    }
+
+    off_t *records = malloc((size / sizeof(JournalRecord) + 1) * sizeof(off_t));
+    int num_records = 0;
+    off_t pos = 0;
+    while (pos + (off_t)sizeof(JournalRecord) <= size) {
+        JournalRecord header;
+        memcpy(&header, journal + pos, sizeof(header));
+        off_t per_block = sizeof(uint32_t) + (header.magic == JOURNAL_MAGIC ? BLOCK_SIZE : 0);
+        off_t body = (off_t)header.count * per_block;
+        if ((header.magic != JOURNAL_MAGIC && header.magic != JOURNAL_REVOKE_MAGIC) ||
+            header.count == 0 || header.count > NUM_BLOCKS ||
+            body > size - pos - (off_t)sizeof(JournalRecord)) {
+            break;
+        }
+        const char *list = journal + pos + sizeof(JournalRecord);
+        if (crc32c(list, body) != header.checksum) break;  // Torn write
+
+        // A block past the end of the disk means the journal is not this disk's
+        uint32_t i = 0;
+        for (; i < header.count; i++) {
+            uint32_t block;
+            memcpy(&block, list + i * sizeof(uint32_t), sizeof(uint32_t));
+            if (block >= NUM_BLOCKS) break;
+        }
+        if (i < header.count) break;
+        records[num_records++] = pos;
+        pos += sizeof(JournalRecord) + body;
+    }
+
+    uint64_t done[NUM_BLOCKS / 64] = {0};
+    unsigned long applied = 0;
+    for (int r = num_records - 1; r >= 0; r--) {
+        JournalRecord header;
+        memcpy(&header, journal + records[r], sizeof(header));
+        const char *list = journal + records[r] + sizeof(JournalRecord);
+        const char *data = list + (size_t)header.count * sizeof(uint32_t);
+        for (uint32_t i = 0; i < header.count; i++) {
+            uint32_t block;
+            memcpy(&block, list + i * sizeof(uint32_t), sizeof(uint32_t));
+            if (block_set_has(done, block)) continue;
+            done[block / 64] |= 1ULL << (block % 64);
+            if (header.magic == JOURNAL_MAGIC) write_block(ctx, fd, block, data + (size_t)i * BLOCK_SIZE);
+        }
+        if (header.magic == JOURNAL_MAGIC) applied++;
+    }
+    if (applied) sync_fd(ctx, fd);
+    ctx->io_stats.journal_replays += applied;
+
+    free(records);
+    free(journal);
+    close(journal_fd);
+    unlinkat(ctx->dir_fd, path, 0);
+}
+
+// Writes extents and, if it changed, the superblock. With the journal on,
+// they are committed to it as one record first, so a crash leaves either
+// all or none of them; without it, the extents go first.
+static void write_transaction(FsContext *ctx, const JournalExtent *extents, int num_extents) {
+    if (ctx->disk_fd == -1) return;
+    int write_superblock = ctx->superblock_dirty &&
+                           memcmp(&ctx->superblock, &ctx->disk_superblock, sizeof(Superblock)) != 0;
+
+    if (ctx->journal && !ctx->journal_stopped && (write_superblock || num_extents > 0)) {
+        // Earlier records are all written in place by now
+        if (ctx->journal_size > (off_t)JOURNAL_CHECKPOINT_BLOCKS * BLOCK_SIZE) journal_checkpoint(ctx, 0);
+
+        JournalExtent all[num_extents + 1];
+        if (num_extents > 0) memcpy(all, extents, num_extents * sizeof(JournalExtent));
+        all[num_extents] = (JournalExtent){0, 1, &ctx->superblock};
+        if (!journal_append(ctx, all, num_extents + write_superblock)) journal_stop(ctx);
+    }
+
+    ctx->journal_committing = 1;  // The record just appended is the newest copy
+    for (int i = 0; i < num_extents; i++) {
+        write_blocks(ctx, ctx->disk_fd, extents[i].block, extents[i].count, extents[i].data);
+    }
+    if (write_superblock) {
+        write_block(ctx, ctx->disk_fd, 0, &ctx->superblock);
+        ctx->io_stats.superblock_writes++;
+        ctx->disk_superblock = ctx->superblock;
+        mount_cache_block0_written(ctx);
+    }
+    ctx->journal_committing = 0;
+    ctx->superblock_dirty = 0;
+    aio_wait(ctx);
+}
+
+static void flush_superblock(FsContext *ctx) {
+    if (!ctx->superblock_dirty || ctx->disk_fd == -1) return;
+    write_transaction(ctx, NULL, 0);
+}
+
+// Zeros blocks a change to the superblock just freed. With the journal on,
+// the change is committed first, so a crash cannot leave an inode pointing
+// at blocks that were already zeroed.
+static void zero_freed_blocks(FsContext *ctx, int block_num, int count) {
+    if (ctx->journal) flush_superblock(ctx);
+    zero_blocks(ctx, ctx->disk_fd, block_num, count);
+}
+
+static void defrag_step(FsContext *ctx);
+
+// Called once per executed command; flushes every flush_interval commands
+static void end_command(FsContext *ctx) {
+    defrag_step(ctx);
+    if (ctx->flush_interval > 0 && ++ctx->commands_since_flush >= ctx->flush_interval) {
+        flush_superblock(ctx);
+        ctx->commands_since_flush = 0;
+    } else if (ctx->flush_ms > 0 && ctx->superblock_dirty &&
+               now_ns() - ctx->dirty_since_ns >= (uint64_t)ctx->flush_ms * 1000000) {
+        flush_superblock(ctx);
+        ctx->commands_since_flush = 0;
+    }
+    aio_wait(ctx);  // The command's writes, with the superblock if it was flushed
+}
+
+static uint64_t name_key(const char name[5], int parent_inode) {
+    uint64_t key = 0;
+    memcpy(&key, name, 5);
+    return key | ((uint64_t)(parent_inode & 0x7F) << 40) | (1ULL << 63);
+}
+
+static int index_slot(uint64_t key) {
+    return (int)((key * 0x9E3779B97F4A7C15ULL) >> 56);
+}
+
+static void index_insert(FsContext *ctx, uint64_t key, int inode_idx) {
+    int slot = index_slot(key);
+    while (ctx->index_keys[slot] != 0) {
+        if (ctx->index_keys[slot] == key) {  // Duplicate name: lowest inode wins, like a scan
+            ctx->index_has_duplicates = 1;
+            if (inode_idx < ctx->index_inodes[slot]) ctx->index_inodes[slot] = inode_idx;
+            return;
+        }
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+    ctx->index_keys[slot] = key;
+    ctx->index_inodes[slot] = inode_idx;
+}
+
+static void index_remove(FsContext *ctx, uint64_t key, int inode_idx) {
+    int slot = index_slot(key);
+    while (ctx->index_keys[slot] != key) {
+        if (ctx->index_keys[slot] == 0) return;
+        slot = (slot + 1) & (INDEX_SLOTS - 1);
+    }
+    if (ctx->index_inodes[slot] != inode_idx) return;
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    int hole = slot;
+    for (int next = (hole + 1) & (INDEX_SLOTS - 1); ctx->index_keys[next] != 0;
+         next = (next + 1) & (INDEX_SLOTS - 1)) {
+        int home = index_slot(ctx->index_keys[next]);
+        if (((next - home) & (INDEX_SLOTS - 1)) >= ((next - hole) & (INDEX_SLOTS - 1))) {
+            ctx->index_keys[hole] = ctx->index_keys[next];
+            ctx->index_inodes[hole] = ctx->index_inodes[next];
+            hole = next;
+        }
+    }
+    ctx->index_keys[hole] = 0;
+
+    // Expose the next inode sharing this name, if the superblock has one
+    if (ctx->index_has_duplicates) {
+        for (int i = 0; i < NUM_INODES; i++) {
+            if (i != inode_idx && (ctx->superblock.inode[i].used_size & 0x80) &&
+                name_key(ctx->superblock.inode[i].name, ctx->superblock.inode[i].dir_parent) == key) {
+                index_insert(ctx, key, i);
+                break;
+            }
+        }
+    }
+}
+
+static void set_bit(uint64_t set[2], int i, int value) {
+    if (value) {
+        set[i / 64] |= 1ULL << (i % 64);
+    } else {
+        set[i / 64] &= ~(1ULL << (i % 64));
+    }
+}
+
+// Add the inode to the in-memory indexes; call after its name and parent are set
+static void index_add_inode(FsContext *ctx, int inode_idx) {
+    const Inode *inode = &ctx->superblock.inode[inode_idx];
+    set_bit(ctx->used_inodes, inode_idx, 1);
+    ctx->namespace_generation++;
+    set_bit(ctx->children[inode->dir_parent & 0x7F], inode_idx, 1);
+    index_insert(ctx, name_key(inode->name, inode->dir_parent), inode_idx);
+}
+
+// Drop the inode from the in-memory indexes; call before it is zeroed
+static void index_remove_inode(FsContext *ctx, int inode_idx) {
+    const Inode *inode = &ctx->superblock.inode[inode_idx];
+    set_bit(ctx->used_inodes, inode_idx, 0);
+    ctx->namespace_generation++;
+    set_bit(ctx->children[inode->dir_parent & 0x7F], inode_idx, 0);
+    index_remove(ctx, name_key(inode->name, inode->dir_parent), inode_idx);
+}
+
+static void rebuild_indexes(FsContext *ctx) {
+    memset(ctx->index_keys, 0, sizeof(ctx->index_keys));
+    memset(ctx->used_inodes, 0, sizeof(ctx->used_inodes));
+    memset(ctx->children, 0, sizeof(ctx->children));
+    ctx->index_has_duplicates = 0;
+    ctx->namespace_generation++;
     for (int i = 0; i < NUM_INODES; i++) {
-        if (!(superblock.inode[i].used_size & 0x80)) {  // Check if inode is free
-            return i;
+        if (ctx->superblock.inode[i].used_size & 0x80) {
+            index_add_inode(ctx, i);
         }
     }
+}
+
+static int child_count(FsContext *ctx, int dir_inode) {
+    return __builtin_popcountll(ctx->children[dir_inode][0]) +
+           __builtin_popcountll(ctx->children[dir_inode][1]);
+}
+
+// Lowest inode index >= from whose parent is dir_inode, or -1
+static int next_child(FsContext *ctx, int dir_inode, int from) {
+    for (int w = from / 64; w < 2; w++) {
+        uint64_t bits = ctx->children[dir_inode][w];
+        if (w == from / 64) bits &= ~0ULL << (from % 64);
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
     return -1;
 }
 
-static int get_file_inode(const char name[5], int parent_inode) {
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&  // Inode is in use
-            (superblock.inode[i].dir_parent & 0x7F) == parent_inode &&  // Same parent
-            memcmp(superblock.inode[i].name, name, 5) == 0) {  // Same name
-            return i;
+static int find_free_inode(FsContext *ctx) {
+    for (int w = 0; w < 2; w++) {
+        uint64_t free_bits = ~ctx->used_inodes[w];
+        if (free_bits) {
+            int i = w * 64 + __builtin_ctzll(free_bits);
+            return i < NUM_INODES ? i : -1;
         }
     }
     return -1;
 }
 
-static int find_contiguous_blocks(int size) {
-    if (size <= 0) return 0;
+static int get_file_inode(FsContext *ctx, const char name[5], int parent_inode) {
+    uint64_t key = name_key(name, parent_inode);
+    for (int slot = index_slot(key); ctx->index_keys[slot] != 0;
+         slot = (slot + 1) & (INDEX_SLOTS - 1)) {
+        if (ctx->index_keys[slot] == key) {
+            return ctx->index_inodes[slot];
+        }
+    }
+    return -1;
+}
+
+// On disk, block i is bit 7 - i % 8 of byte i / 8 (most significant bit
+// first, so block 0 is 0x80 of byte 0)
+#define BLOCK_BIT(i) (0x80 >> ((i) % 8))
 
-    int current_start = 1;  
-    int current_count = 0;
+static uint8_t reverse_bits(uint8_t byte) {
+    byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+    byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+    return (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+}
 
-    for (int i = 1; i < NUM_BLOCKS; i++) {
-        int byte_idx = i / 8;
-        int bit_idx = i % 8;
-        
-        if (!(superblock.free_block_list[byte_idx] & (1 << bit_idx))) {  // Block is free
-            if (current_count == 0) {
-                current_start = i;
+// The free block list as two 64-bit words: block i is bit i % 64 of word i / 64
+static void load_block_bitmap(FsContext *ctx, uint64_t used[2]) {
+    for (int w = 0; w < 2; w++) {
+        uint64_t bits = 0;
+        for (int b = 7; b >= 0; b--) {
+            bits = (bits << 8) | reverse_bits(ctx->superblock.free_block_list[w * 8 + b]);
+        }
+        used[w] = bits;
+    }
+}
+
+static void store_block_bitmap(FsContext *ctx, const uint64_t used[2]) {
+    for (int w = 0; w < 2; w++) {
+        for (int b = 0; b < 8; b++) {
+            ctx->superblock.free_block_list[w * 8 + b] = (char)reverse_bits(used[w] >> (b * 8));
+        }
+    }
+    ctx->free_extents_valid = 0;
+}
+
+// Mask of blocks [from, to) that fall in word w
+static uint64_t range_mask(int w, int from, int to) {
+    int lo = from > w * 64 ? from - w * 64 : 0;
+    int hi = to < (w + 1) * 64 ? to - w * 64 : 64;
+    if (lo >= hi) return 0;
+    uint64_t upper = hi == 64 ? ~0ULL : (1ULL << hi) - 1;
+    return upper & (~0ULL << lo);
+}
+
+// First block >= from whose bit equals value, or NUM_BLOCKS if there is none
+static int next_block_with(const uint64_t used[2], int from, int value) {
+    for (int w = from / 64; w < 2; w++) {
+        uint64_t bits = value ? used[w] : ~used[w];
+        bits &= range_mask(w, from, NUM_BLOCKS);
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
+    return NUM_BLOCKS;
+}
+
+static void rebuild_free_extents(FsContext *ctx) {
+    uint64_t used[2];
+    load_block_bitmap(ctx, used);
+    ctx->num_free_extents = 0;
+    int start = next_block_with(used, 1, 0);
+    while (start < NUM_BLOCKS) {
+        int end = next_block_with(used, start, 1);
+        ctx->free_extents[ctx->num_free_extents].start = start;
+        ctx->free_extents[ctx->num_free_extents].length = end - start;
+        ctx->num_free_extents++;
+        start = next_block_with(used, end, 0);
+    }
+    ctx->free_extents_valid = 1;
+}
+
+static int find_contiguous_blocks(FsContext *ctx, int size) {
+    if (size <= 0) return 0;
+
+    if (!ctx->free_extents_valid) rebuild_free_extents(ctx);
+    int found = -1;
+    switch (ctx->alloc_policy) {
+        case ALLOC_FIRST_FIT:
+            for (int i = 0; i < ctx->num_free_extents && found == -1; i++) {
+                if (ctx->free_extents[i].length >= size) found = i;
             }
-            current_count++;
-            if (current_count == size) {
-                return current_start;
+            return found == -1 ? -1 : ctx->free_extents[found].start;
+
+        case ALLOC_BEST_FIT:
+        case ALLOC_WORST_FIT:
+            for (int i = 0; i < ctx->num_free_extents; i++) {
+                if (ctx->free_extents[i].length < size) continue;
+                if (found == -1 ||
+                    (ctx->alloc_policy == ALLOC_BEST_FIT ?
+                     ctx->free_extents[i].length < ctx->free_extents[found].length :
+                     ctx->free_extents[i].length > ctx->free_extents[found].length)) {
+                    found = i;
+                }
             }
-        } else {
-            current_count = 0;
-        }
+            return found == -1 ? -1 : ctx->free_extents[found].start;
+
+        case ALLOC_NEXT_FIT:
+            // Extents from the rover onwards (an extent spanning the rover
+            // only counts from the rover), then wrap around to the start
+            for (int pass = 0; pass < 2; pass++) {
+                for (int i = 0; i < ctx->num_free_extents; i++) {
+                    int start = ctx->free_extents[i].start;
+                    int end = start + ctx->free_extents[i].length;
+                    if (pass == 0) {
+                        if (end <= ctx->next_fit_block) continue;
+                        if (start < ctx->next_fit_block) start = ctx->next_fit_block;
+                    }
+                    if (end - start >= size) {
+                        ctx->next_fit_block = start + size;
+                        return start;
+                    }
+                }
+            }
+            return -1;
     }
     return -1;
 }
 
-static void mark_blocks(int start_block, int num_blocks, int mark) {
-    for (int i = 0; i < num_blocks; i++) {
-        int block = start_block + i;
-        if (block < 0 || block >= NUM_BLOCKS) continue;
-        
-        int byte_idx = block / 8;
-        int bit_idx = block % 8;
-        
-        // Initialize superblock as used
-        if (block == 0) {
-            superblock.free_block_list[0] |= 1;  // Always mark first bit as used
-            continue;
-        }
-        
+// Whether every block in [from, to) is free; blocks past the disk end are not
+static int blocks_are_free(FsContext *ctx, int from, int to) {
+    if (to > NUM_BLOCKS) return 0;
+    uint64_t used[2];
+    load_block_bitmap(ctx, used);
+    return !(used[0] & range_mask(0, from, to)) && !(used[1] & range_mask(1, from, to));
+}
+
+// Whether every block in [from, to) is in use; blocks past the disk end are not
+static int blocks_are_used(FsContext *ctx, int from, int to) {
+    if (to > NUM_BLOCKS) return 0;
+    uint64_t used[2];
+    load_block_bitmap(ctx, used);
+    return (used[0] & range_mask(0, from, to)) == range_mask(0, from, to) &&
+           (used[1] & range_mask(1, from, to)) == range_mask(1, from, to);
+}
+
+static void mark_blocks(FsContext *ctx, int start_block, int num_blocks, int mark) {
+    int from = start_block < 0 ? 0 : start_block;
+    int to = start_block + num_blocks > NUM_BLOCKS ? NUM_BLOCKS : start_block + num_blocks;
+    if (from >= to) return;
+
+    uint64_t used[2];
+    load_block_bitmap(ctx, used);
+    for (int w = 0; w < 2; w++) {
         if (mark) {
-            superblock.free_block_list[byte_idx] |= (1 << bit_idx);
+            used[w] |= range_mask(w, from, to);
         } else {
-            superblock.free_block_list[byte_idx] &= ~(1 << bit_idx);
+            used[w] &= ~range_mask(w, from, to);
         }
     }
+    used[0] |= 1;  // The superblock always stays marked as used
+    store_block_bitmap(ctx, used);
 }
 
-static int check_consistency(void) {
-    // Check 1: Verify free inodes
+// Validates the superblock in one pass over the inode table. Failures are
+// reported with the same precedence as running checks 1-6 one after
+// another: check 1 returns immediately, the others keep the lowest code.
+static int check_consistency(FsContext *ctx) {
+    int error = 0;
+    uint64_t names[INDEX_SLOTS] = {0};  // (parent, name) keys seen so far
+    uint64_t owned[2] = {1, 0};         // Blocks owned by files; block 0 is the superblock
+
     for (int i = 0; i < NUM_INODES; i++) {
-        if (!(superblock.inode[i].used_size & 0x80)) {  // If inode is free
-            if (superblock.inode[i].used_size != 0 || superblock.inode[i].start_block != 0 ||
-                superblock.inode[i].dir_parent != 0) {
+        const Inode *inode = &ctx->superblock.inode[i];
+
+        // Check 1: Free inodes must be entirely zero, and names of used ones not
+        int named = 0;
+        for (int j = 0; j < 5; j++) {
+            if (inode->name[j] != 0) named = 1;
+        }
+        if (!(inode->used_size & 0x80)) {
+            if (inode->used_size != 0 || inode->start_block != 0 || inode->dir_parent != 0 || named) {
                 return 1;
             }
-            // Check if name is non-zero
-            for (int j = 0; j < 5; j++) {
-                if (superblock.inode[i].name[j] != 0) {
-                    return 1;
+            continue;
+        }
+        if (!named) return 1;
+
+        int size = inode->used_size & 0x7F;
+        int start = inode->start_block;
+        if (!(inode->dir_parent & 0x80)) {
+            // Check 2: Valid start block and size for files
+            if (start < 1 || start > 127 || start + size - 1 > 127) {
+                if (!error || error > 2) error = 2;
+            } else {
+                // Check 6: No block may belong to two files
+                for (int w = 0; w < 2; w++) {
+                    uint64_t mask = range_mask(w, start, start + size);
+                    if (owned[w] & mask) error = error ? error : 6;
+                    owned[w] |= mask;
                 }
             }
+        } else if (start != 0 || size != 0) {
+            // Check 3: Directory attributes
+            if (!error || error > 3) error = 3;
+        }
+
+        // Check 4: Parent must be the root or an in-use directory
+        int parent = inode->dir_parent & 0x7F;
+        if (parent != ROOT_INODE && (parent >= NUM_INODES ||
+            !(ctx->superblock.inode[parent].used_size & 0x80) ||
+            !(ctx->superblock.inode[parent].dir_parent & 0x80))) {
+            if (!error || error > 4) error = 4;
         }
+
+        // Check 5: Unique names within directories
+        uint64_t key = name_key(inode->name, parent);
+        int slot = index_slot(key);
+        while (names[slot] != 0 && names[slot] != key) {
+            slot = (slot + 1) & (INDEX_SLOTS - 1);
+        }
+        if (names[slot] == key) {
+            if (!error || error > 5) error = 5;
+        }
+        names[slot] = key;
     }
 
-    // Check 2: Valid start block and size for files
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&  // Inode is in use
-            !(superblock.inode[i].dir_parent & 0x80)) {  // Not a directory
-            int size = superblock.inode[i].used_size & 0x7F;
-            if (superblock.inode[i].start_block < 1 || superblock.inode[i].start_block > 127 ||
-                superblock.inode[i].start_block + size - 1 > 127) {
-                return 2;
-            }
+    // Check 6: Free block list must match the blocks files own
+    uint64_t used[2];
+    load_block_bitmap(ctx, used);
+    if (used[0] != owned[0] || used[1] != owned[1]) {
+        if (!error) error = 6;
+    }
+
+    return error;
+}
+
+// CRC32C (Castagnoli), using the SSE4.2 instruction when the CPU has it
+static uint32_t crc32c_table[256];
+
+__attribute__((constructor)) static void init_crc32c_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
         }
+        crc32c_table[i] = crc;
     }
+}
 
-    // Check 3: Directory attributes
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&  // Inode is in use
-            (superblock.inode[i].dir_parent & 0x80)) {  // Is a directory
-            if (superblock.inode[i].start_block != 0 ||
-                (superblock.inode[i].used_size & 0x7F) != 0) {
-                return 3;
-            }
+static uint32_t crc32c_portable(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint32_t crc = ~0U;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ bytes[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint64_t crc = ~0U;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        crc = __builtin_ia32_crc32di(crc, word);
+    }
+    for (; i < len; i++) {
+        crc = __builtin_ia32_crc32qi((uint32_t)crc, bytes[i]);
+    }
+    return ~(uint32_t)crc;
+}
+#endif
+
+static uint32_t crc32c(const void *data, size_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_sse42(data, len);
+#endif
+    return crc32c_portable(data, len);
+}
+
+static MountCacheEntry *mount_cache_find(FsContext *ctx, const struct stat *st) {
+    for (int i = 0; i < MOUNT_CACHE_SLOTS; i++) {
+        if (ctx->mount_cache[i].valid && ctx->mount_cache[i].dev == st->st_dev &&
+            ctx->mount_cache[i].ino == st->st_ino) {
+            return &ctx->mount_cache[i];
         }
     }
+    return NULL;
+}
 
-    // Check 4: Parent directory validity
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (superblock.inode[i].used_size & 0x80) {  // Inode is in use
-            int parent = superblock.inode[i].dir_parent & 0x7F;
-            if (parent == 126) {
-                return 4;
-            }
-            if (parent < 0 || parent >= NUM_INODES) {  // Invalid parent index
-                return 4;
-            }
-            if (parent != 127 && (!(superblock.inode[parent].used_size & 0x80) ||  // Parent must be in use
-                !(superblock.inode[parent].dir_parent & 0x80))) {  // Parent must be directory
-                return 4;
+static int mount_cache_unchanged(const MountCacheEntry *entry, const struct stat *st) {
+    return entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+           entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void mount_cache_set_identity(FsContext *ctx, MountCacheEntry *entry, const struct stat *st) {
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->last_used = ++ctx->mount_cache_clock;
+}
+
+static MountCacheEntry *mount_cache_store(FsContext *ctx, const struct stat *st, const Superblock *raw,
+                                          int consistency) {
+    MountCacheEntry *entry = mount_cache_find(ctx, st);
+    if (!entry) {  // Take a free slot, else the least recently used one
+        entry = &ctx->mount_cache[0];
+        for (int i = 0; i < MOUNT_CACHE_SLOTS && entry->valid; i++) {
+            if (!ctx->mount_cache[i].valid || ctx->mount_cache[i].last_used < entry->last_used) {
+                entry = &ctx->mount_cache[i];
             }
         }
     }
+    entry->valid = 1;
+    mount_cache_set_identity(ctx, entry, st);
+    entry->raw = *raw;
+    entry->checksum = crc32c(raw, sizeof(Superblock));
+    entry->consistency = consistency;
+    return entry;
+}
 
-    // Check 5: Unique names within directories
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80)) {  // Inode is in use
-            int parent = superblock.inode[i].dir_parent & 0x7F;
-            for (int j = i + 1; j < NUM_INODES; j++) {
-                if ((superblock.inode[j].used_size & 0x80) &&  // Other inode is in use
-                    (superblock.inode[j].dir_parent & 0x7F) == parent &&  // Same parent
-                    memcmp(superblock.inode[i].name, superblock.inode[j].name, 5) == 0) {  // Same name
-                    return 5;
-                }
-            }
+// The cached superblock of the mounted disk is stale now. Timestamps may not
+// advance between two writes, so its identity can no longer prove a hit.
+static void mount_cache_block0_written(FsContext *ctx) {
+    for (int i = 0; i < MOUNT_CACHE_SLOTS; i++) {
+        if (ctx->mount_cache[i].valid && ctx->mount_cache[i].dev == ctx->current_dev &&
+            ctx->mount_cache[i].ino == ctx->current_ino) {
+            ctx->mount_cache[i].size = -1;
+        }
+    }
+}
+
+// Before leaving the mounted disk: if its block 0 is still the cached one,
+// only data blocks changed, so refresh the identity for the next remount
+static void mount_cache_refresh_current(FsContext *ctx) {
+    struct stat st;
+    if (ctx->disk_fd == -1 || fstat(ctx->disk_fd, &st) == -1) return;
+    MountCacheEntry *entry = mount_cache_find(ctx, &st);
+    if (entry && memcmp(&entry->raw, &ctx->disk_superblock, sizeof(Superblock)) == 0) {
+        mount_cache_set_identity(ctx, entry, &st);
+    }
+}
+
+static int active_is_consistent(FsContext *ctx) {
+    if (!ctx->active_consistent) ctx->active_consistent = check_consistency(ctx) == 0;
+    return ctx->active_consistent;
+}
+
+static ParkedMount *mount_table_find(FsContext *ctx, dev_t dev, ino_t ino) {
+    for (int i = 0; i < MOUNT_TABLE_SLOTS; i++) {
+        ParkedMount *pm = &ctx->mount_table[i];
+        if (pm->valid && pm->dev == dev && pm->ino == ino) return pm;
+    }
+    return NULL;
+}
+
+static void mount_table_drop(ParkedMount *pm, int close_fd) {
+    if (close_fd) close(pm->fd);
+    pm->valid = 0;
+}
+
+// Parks the active image (after a flush) if it is consistent, so switching
+// back can skip the mount; returns NULL if it was not parked
+static ParkedMount *mount_table_park(FsContext *ctx) {
+    struct stat st;
+    if (ctx->disk_fd == -1 || !active_is_consistent(ctx) || fstat(ctx->disk_fd, &st) == -1) {
+        return NULL;
+    }
+
+    ParkedMount *pm = &ctx->mount_table[0];  // A free slot, else the least recently used
+    for (int i = 0; i < MOUNT_TABLE_SLOTS && pm->valid; i++) {
+        if (!ctx->mount_table[i].valid || ctx->mount_table[i].last_used < pm->last_used) {
+            pm = &ctx->mount_table[i];
         }
     }
+    if (pm->valid) mount_table_drop(pm, 1);
+
+    pm->valid = 1;
+    pm->fd = ctx->disk_fd;
+    pm->dev = st.st_dev;
+    pm->ino = st.st_ino;
+    pm->size = st.st_size;
+    pm->mtime = st.st_mtim;
+    pm->superblock = ctx->superblock;
+    pm->disk_superblock = ctx->disk_superblock;
+    memcpy(pm->index_keys, ctx->index_keys, sizeof(pm->index_keys));
+    memcpy(pm->index_inodes, ctx->index_inodes, sizeof(pm->index_inodes));
+    pm->index_has_duplicates = ctx->index_has_duplicates;
+    memcpy(pm->used_inodes, ctx->used_inodes, sizeof(pm->used_inodes));
+    memcpy(pm->children, ctx->children, sizeof(pm->children));
+    memcpy(pm->free_extents, ctx->free_extents, sizeof(pm->free_extents));
+    pm->num_free_extents = ctx->num_free_extents;
+    pm->free_extents_valid = ctx->free_extents_valid;
+    pm->last_used = ++ctx->mount_table_clock;
+    return pm;
+}
+
+static void mount_table_unpark(FsContext *ctx, ParkedMount *pm) {
+    ctx->disk_fd = pm->fd;
+    ctx->current_dev = pm->dev;
+    ctx->current_ino = pm->ino;
+    ctx->superblock = pm->superblock;
+    ctx->disk_superblock = pm->disk_superblock;
+    memcpy(ctx->index_keys, pm->index_keys, sizeof(ctx->index_keys));
+    memcpy(ctx->index_inodes, pm->index_inodes, sizeof(ctx->index_inodes));
+    ctx->index_has_duplicates = pm->index_has_duplicates;
+    memcpy(ctx->used_inodes, pm->used_inodes, sizeof(ctx->used_inodes));
+    memcpy(ctx->children, pm->children, sizeof(ctx->children));
+    ctx->namespace_generation++;
+    memcpy(ctx->free_extents, pm->free_extents, sizeof(ctx->free_extents));
+    ctx->num_free_extents = pm->num_free_extents;
+    ctx->free_extents_valid = pm->free_extents_valid;
+    mount_table_drop(pm, 0);
+}
+
+// Mounts without touching the disk when the image is the active one or a
+// parked one, unchanged and consistent. Returns 0 if a full mount is needed;
+// that path reports any error, so only known-good images are switched here.
+static int mount_table_switch(FsContext *ctx, const char *new_disk_name) {
+    struct stat st;
+    if (fstatat(ctx->dir_fd, new_disk_name, &st, 0) == -1) return 0;
+
+    int active = ctx->disk_fd != -1 && st.st_dev == ctx->current_dev && st.st_ino == ctx->current_ino;
+    ParkedMount *pm = active ? NULL : mount_table_find(ctx, st.st_dev, st.st_ino);
+    if (!active) {
+        if (!pm) return 0;
+        if (pm->size != st.st_size || pm->mtime.tv_sec != st.st_mtim.tv_sec ||
+            pm->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            mount_table_drop(pm, 1);  // Changed behind our back
+            return 0;
+        }
+    }
+
+    flush_superblock(ctx);
+    aio_wait(ctx);
+    mount_cache_refresh_current(ctx);
+    if (active) {
+        if (!active_is_consistent(ctx)) return 0;
+    } else {
+        journal_checkpoint(ctx, 1);
+        if (!mount_table_park(ctx) && ctx->disk_fd != -1) close(ctx->disk_fd);
+        mount_table_unpark(ctx, pm);
+        ctx->active_consistent = 1;
+        block_cache_clear(ctx);
+    }
+    ctx->mount_table_switches++;
+
+    // What a full mount resets
+    ctx->next_fit_block = 1;
+    free(ctx->current_disk);
+    ctx->current_disk = strdup(new_disk_name);
+    ctx->current_dir_inode = ROOT_INODE;
+    clear_buffer(ctx);
+    return 1;
+}
+
+void fs_mount(FsContext *ctx, char *new_disk_name) {
+    if (mount_table_switch(ctx, new_disk_name)) return;
+
+    int fd = openat(ctx->dir_fd, new_disk_name, O_RDWR);
+    ctx->io_stats.opens++;
+    if (fd == -1) {
+        fprintf(ctx->err, "Error: Cannot find disk %s\n", new_disk_name);
+        return;
+    }
+
+    // Persist pending changes to the current disk before replacing the
+    // superblock, and park it in case the new disk mounts
+    flush_superblock(ctx);
+    aio_wait(ctx);
+    mount_cache_refresh_current(ctx);
+    journal_checkpoint(ctx, 1);
+    ParkedMount *parked = mount_table_park(ctx);
+    ctx->active_consistent = 0;
+
+    // Finish any transactions a crash interrupted before looking at the disk
+    journal_replay(ctx, fd, new_disk_name);
+    block_cache_clear(ctx);  // Even if the mount fails, the replay may have rewritten the active image
+
+    // The identity keys the mount cache and the mount table; without it the
+    // disk cannot be mounted (the current one stays)
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fprintf(ctx->err, "Error: Cannot find disk %s\n", new_disk_name);
+        close(fd);
+        if (parked) mount_table_drop(parked, 0);
+        return;
+    }
+
+    // Read superblock, unless this exact image was validated before
+    int consistency;
+    MountCacheEntry *cached = mount_cache_find(ctx, &st);
+    if (cached && mount_cache_unchanged(cached, &st)) {
+        ctx->mount_cache_hits++;
+        cached->last_used = ++ctx->mount_cache_clock;
+        ctx->superblock = cached->raw;
+        consistency = cached->consistency;
+    } else {
+        read_block(ctx, fd, 0, &ctx->superblock);
+        consistency = -1;
+        if (cached && cached->checksum == crc32c(&ctx->superblock, sizeof(Superblock)) &&
+            memcmp(&cached->raw, &ctx->superblock, sizeof(Superblock)) == 0) {
+            ctx->mount_cache_checksum_hits++;
+            mount_cache_set_identity(ctx, cached, &st);
+            consistency = cached->consistency;
+        }
+    }
+    Superblock on_disk = ctx->superblock;
+    ctx->superblock.free_block_list[0] |= BLOCK_BIT(0);
+    rebuild_indexes(ctx);
+    rebuild_free_extents(ctx);
+    ctx->next_fit_block = 1;
+
+    // Check consistency
+    if (consistency == -1) {
+        ctx->mount_cache_misses++;
+        consistency = check_consistency(ctx);
+        mount_cache_store(ctx, &st, &on_disk, consistency);
+    }
+    if (consistency != 0) {
+        // The current disk stays mounted, but with the superblock just read
+        fprintf(ctx->err, "Error: File system in %s is inconsistent (error code: %d)\n",
+                new_disk_name, consistency);
+        close(fd);
+        if (parked) mount_table_drop(parked, 0);
+        return;
+    }
+
+    // Update current disk and directory, keeping the new disk open and the
+    // old one parked (or closed). A parked copy of the new disk is stale.
+    ParkedMount *stale = mount_table_find(ctx, st.st_dev, st.st_ino);
+    if (stale && stale != parked) mount_table_drop(stale, 1);
+    if (!parked && ctx->disk_fd != -1) close(ctx->disk_fd);
+    ctx->active_consistent = 1;
+    ctx->disk_fd = fd;
+    ctx->disk_superblock = on_disk;
+    ctx->current_dev = st.st_dev;
+    ctx->current_ino = st.st_ino;
+    if (ctx->current_disk) free(ctx->current_disk);
+    ctx->current_disk = strdup(new_disk_name);
+    ctx->current_dir_inode = ROOT_INODE;
+
+    // Zero out buffer
+    clear_buffer(ctx);
+}
+
+// Creates a file (or a directory if size is 0) in the current directory;
+// returns its inode, or -1 after reporting why it cannot
+static int create_inode(FsContext *ctx, const char *name, int size) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return -1;
+    }
+
+    // Check if name exists in current directory
+    if (get_file_inode(ctx, name, ctx->current_dir_inode) != -1) {
+        fprintf(ctx->err, "Error: File or directory %s already exists\n", name);
+        return -1;
+    }
+
+    // Find free inode
+    int inode_idx = find_free_inode(ctx);
+    if (inode_idx == -1) {
+        fprintf(ctx->err, "Error: Superblock in disk %s is full, cannot create %s\n",
+                ctx->current_disk, name);
+        return -1;
+    }
+
+    // For files, find contiguous blocks
+    int start_block = 0;
+    if (size > 0) {
+        start_block = find_contiguous_blocks(ctx, size);
+        if (start_block == -1) {
+            fprintf(ctx->err, "Error: Cannot allocate %d blocks on %s\n", size, ctx->current_disk);
+            return -1;
+        }
+    }
+
+    // Initialize inode with proper values
+    memcpy(ctx->superblock.inode[inode_idx].name, name, 5);
+    ctx->superblock.inode[inode_idx].used_size = 0x80 | (size & 0x7F); 
+    ctx->superblock.inode[inode_idx].start_block = start_block;
+    ctx->superblock.inode[inode_idx].dir_parent = (size == 0 ? 0x80 : 0) | (ctx->current_dir_inode & 0x7F);
+    index_add_inode(ctx, inode_idx);
+
+    // Mark blocks as used
+    if (size > 0) {
+        mark_blocks(ctx, start_block, size, 1);
+    }
+
+    mark_superblock_dirty(ctx);
+    return inode_idx;
+}
+
+void fs_create(FsContext *ctx, char name[5], int size) {
+    create_inode(ctx, name, size);
+}
+
+static int compare_extent_start(const void *a, const void *b) {
+    const Extent *ea = a, *eb = b;
+    return ea->start - eb->start;
+}
+
+// Deletes a file, or a directory with everything below it. The subtree is
+// collected by inode index through the children bitsets, so nested entries
+// are found under their own parent and a parent cycle on a corrupt disk
+// ends. All inodes are then cleared with one superblock change, and the
+// freed extents, merged into maximal runs, are zeroed one run per call.
+void fs_delete(FsContext *ctx, char name[5]) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1) {
+        fprintf(ctx->err, "Error: File or directory %-5.*s does not exist\n", 5, name);
+        return;
+    }
+
+    // Collect the subtree: subtree[0..count) in discovery order
+    uint64_t collected[2] = {0, 0};
+    int subtree[NUM_INODES];
+    int count = 0;
+    set_bit(collected, inode_idx, 1);
+    subtree[count++] = inode_idx;
+    for (int n = 0; n < count; n++) {
+        int dir_inode = subtree[n];
+        if (!(ctx->superblock.inode[dir_inode].dir_parent & 0x80)) continue;
+        for (int i = next_child(ctx, dir_inode, 0); i != -1; i = next_child(ctx, dir_inode, i + 1)) {
+            if (collected[i / 64] & (1ULL << (i % 64))) continue;
+            set_bit(collected, i, 1);
+            subtree[count++] = i;
+        }
+    }
+
+    // Free the files' blocks and clear every inode (directories have no blocks)
+    Extent freed[NUM_INODES];
+    int num_freed = 0;
+    for (int n = 0; n < count; n++) {
+        Inode *inode = &ctx->superblock.inode[subtree[n]];
+        if (!(inode->dir_parent & 0x80) && (inode->used_size & 0x7F) > 0) {
+            freed[num_freed].start = inode->start_block;
+            freed[num_freed].length = inode->used_size & 0x7F;
+            mark_blocks(ctx, freed[num_freed].start, freed[num_freed].length, 0);
+            num_freed++;
+        }
+        index_remove_inode(ctx, subtree[n]);
+        memset(inode, 0, sizeof(Inode));
+    }
+    // Only a parent cycle can reach the current directory; fall back to root
+    if (collected[ctx->current_dir_inode / 64] & (1ULL << (ctx->current_dir_inode % 64))) {
+        ctx->current_dir_inode = ROOT_INODE;
+    }
+    mark_superblock_dirty(ctx);
+
+    // Zero the freed blocks, one call per run of adjacent or overlapping extents
+    qsort(freed, num_freed, sizeof(Extent), compare_extent_start);
+    for (int n = 0; n < num_freed;) {
+        int start = freed[n].start;
+        int end = start + freed[n].length;
+        for (n++; n < num_freed && freed[n].start <= end; n++) {
+            if (freed[n].start + freed[n].length > end) end = freed[n].start + freed[n].length;
+        }
+        zero_freed_blocks(ctx, start, end - start);
+    }
+}
 
-    // // Check 6: Block allocation consistency
-    // int block_used[NUM_BLOCKS] = {0};
-    // block_used[0] = 1;  // Superblock is always used
-
-    // // Scan all inodes and mark blocks they use
-    // for (int i = 0; i < NUM_INODES; i++) {
-    //     if ((superblock.inode[i].used_size & 0x80) &&  // Inode is in use
-    //         !(superblock.inode[i].dir_parent & 0x80)) {  // Not a directory
-    //         int size = superblock.inode[i].used_size & 0x7F;
-    //         int start = superblock.inode[i].start_block;
-            
-    //         // Validate block range
-    //         if (start + size > NUM_BLOCKS) {
-    //             return 6;
-    //         }
-            
-    //         // Check if blocks are already marked as used
-    //         for (int j = 0; j < size; j++) {
-    //             if (block_used[start + j]) {
-    //                 return 6;  // Block allocated to multiple files
-    //             }
-    //             block_used[start + j] = 1;
-    //         }
-    //     }
-    // }
-
-    // // Compare with free space list
-    // for (int i = 0; i < NUM_BLOCKS; i++) {
-    //     int byte_idx = i / 8;
-    //     int bit_idx = i % 8;
-    //     int is_marked = (superblock.free_block_list[byte_idx] & (1 << bit_idx)) ? 1 : 0;
-        
-    //     if (is_marked != block_used[i]) {
-    //         return 6;  // Mismatch between free space list and actual block usage
-    //     }
-    // }
+// Reads block block_num of a file into the buffer through the block cache.
+// A miss right after R read the previous block of the same file reads ahead
+// through the rest of the file, whose blocks follow on disk.
+static void read_file_block(FsContext *ctx, int inode_idx, int block_num) {
+    const Inode *inode = &ctx->superblock.inode[inode_idx];
+    int block = inode->start_block + block_num;
+    int sequential = inode_idx == ctx->last_read_inode && block_num == ctx->last_read_block + 1;
+    ctx->last_read_inode = inode_idx;
+    ctx->last_read_block = block_num;
+    if (!ctx->block_cache_size || block >= NUM_BLOCKS) {
+        read_block(ctx, ctx->disk_fd, block, ctx->buffer);
+        return;
+    }
 
-    return 0;
+    int slot = ctx->block_cache_slot[block];
+    if (slot != -1) {
+        ctx->block_cache_hits++;
+        ctx->block_cache[slot].referenced = 1;
+        memcpy(ctx->buffer, ctx->block_cache_data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+        return;
+    }
+    ctx->block_cache_misses++;
+
+    int count = 1;
+    if (sequential) {
+        count = (inode->used_size & 0x7F) - block_num;
+        if (count > ctx->block_cache_size / 2) count = ctx->block_cache_size / 2;
+        if (count > NUM_BLOCKS - block) count = NUM_BLOCKS - block;
+        if (count < 1) count = 1;
+    }
+    char *area = ctx->block_cache_data + (size_t)ctx->block_cache_size * BLOCK_SIZE;
+    ssize_t n = read_blocks(ctx, ctx->disk_fd, block, count, area);
+    if (n > 0) memcpy(ctx->buffer, area, n < BLOCK_SIZE ? n : BLOCK_SIZE);
+
+    // Only whole blocks are cached; a short read past the end of the image
+    // is left to be retried
+    for (int i = 0; i < count && n >= (ssize_t)(i + 1) * BLOCK_SIZE; i++) {
+        if (i > 0 && ctx->block_cache_slot[block + i] != -1) continue;  // Already current
+        block_cache_insert(ctx, block + i, area + (size_t)i * BLOCK_SIZE, i == 0);
+        if (i > 0) ctx->block_cache_readahead++;
+    }
 }
 
-void fs_mount(char *new_disk_name) {
-    FILE *disk = fopen(new_disk_name, "r+b");
-    if (!disk) {
-        fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
+void fs_read(FsContext *ctx, char name[5], int block_num) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
-    // Read superblock
-    read_block(disk, 0, &superblock);
-    superblock.free_block_list[0] |= 1;
-    fclose(disk);
-
-    // Check consistency
-    int consistency = check_consistency();
-    if (consistency != 0) {
-        fprintf(stderr, "Error: File system in %s is inconsistent (error code: %d)\n",
-                new_disk_name, consistency);
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1 || (ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: File %-5.*s does not exist\n", 5, name);
         return;
     }
 
-    // Update current disk and directory
-    if (current_disk) free(current_disk);
-    current_disk = strdup(new_disk_name);
-    current_dir_inode = 0;
+    int size = ctx->superblock.inode[inode_idx].used_size & 0x7F;
+    if (block_num < 0 || block_num >= size) {
+        fprintf(ctx->err, "Error: %s does not have block %d\n", name, block_num);
+        return;
+    }
 
-    // Zero out buffer
-    memset(buffer, 0, 1024);
+    read_file_block(ctx, inode_idx, block_num);
 }
 
-void fs_create(char name[5], int size) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+void fs_write(FsContext *ctx, char name[5], int block_num) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
-    // Check if name exists in current directory
-    if (get_file_inode(name, current_dir_inode) != -1) {
-        fprintf(stderr, "Error: File or directory %s already exists\n", name);
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1 || (ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: File %-5.*s does not exist\n", 5, name);
         return;
     }
 
-    // Find free inode
-    int inode_idx = find_free_inode();
-    if (inode_idx == -1) {
-        fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n",
-                current_disk, name);
+    int size = ctx->superblock.inode[inode_idx].used_size & 0x7F;
+    if (block_num < 0 || block_num >= size) {
+        fprintf(ctx->err, "Error: %s does not have block %d\n", name, block_num);
         return;
     }
 
-    // For files, find contiguous blocks
-    int start_block = 0;
-    if (size > 0) {
-        start_block = find_contiguous_blocks(size);
-        if (start_block == -1) {
-            fprintf(stderr, "Error: Cannot allocate %d blocks on %s\n", size, current_disk);
-            return;
-        }
-    }
-
-    // Initialize inode with proper values
-    memcpy(superblock.inode[inode_idx].name, name, 5);
-    superblock.inode[inode_idx].used_size = 0x80 | (size & 0x7F); 
-    superblock.inode[inode_idx].start_block = start_block;
-    superblock.inode[inode_idx].dir_parent = (size == 0 ? 0x80 : 0) | (current_dir_inode & 0x7F);
+    // Calculate actual block number
+    int actual_block = ctx->superblock.inode[inode_idx].start_block + block_num;
 
-    // Mark blocks as used
-    if (size > 0) {
-        mark_blocks(start_block, size, 1);
+    // Make sure block is marked as used in free block list
+    if (!(ctx->superblock.free_block_list[actual_block / 8] & BLOCK_BIT(actual_block))) {
+        fprintf(ctx->err, "Error: Attempting to write to an unallocated block\n");
+        return;
     }
+    // Superblock is unchanged, but still has to reach disk if it is stale there
+    mark_superblock_dirty(ctx);
 
-    // Write superblock back to disk
-    FILE *disk = fopen(current_disk, "r+b");
-    write_block(disk, 0, &superblock);
-    fclose(disk);
+    // Write buffer content to the specified block
+    write_block(ctx, ctx->disk_fd, actual_block, ctx->buffer);
 }
 
-void fs_delete(char name[5]) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
-        return;
+// Looks up a file in the current directory for G and P and checks that it
+// has blocks [first, first + count); returns its inode or -1
+static int range_file_inode(FsContext *ctx, const char name[5], int first, int count) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return -1;
     }
 
-    int inode_idx = get_file_inode(name, current_dir_inode);
-    if (inode_idx == -1) {
-        fprintf(stderr, "Error: File or directory %-5.*s does not exist\n", 5, name);
-        return;
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1 || (ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: File %-5.*s does not exist\n", 5, name);
+        return -1;
     }
 
-    // If it's a directory, recursively delete contents
-    if (superblock.inode[inode_idx].dir_parent & 0x80) {
-        for (int i = 0; i < NUM_INODES; i++) {
-            if ((superblock.inode[i].used_size & 0x80) &&
-                (superblock.inode[i].dir_parent & 0x7F) == inode_idx) {
-                fs_delete(superblock.inode[i].name);
-            }
-        }
-    } else {
-        // Free blocks
-        int size = superblock.inode[inode_idx].used_size & 0x7F;
-        mark_blocks(superblock.inode[inode_idx].start_block, size, 0);
-
-        // Zero out blocks
-        FILE *disk = fopen(current_disk, "r+b");
-        if (!disk) {
-            fprintf(stderr, "Error: Cannot open disk %s\n", current_disk);
-            return;
-        }
-
-        uint8_t zero_block[BLOCK_SIZE] = {0};
-        for (int i = 0; i < size; i++) {
-            write_block(disk, superblock.inode[inode_idx].start_block + i, zero_block);
-        }
-        fclose(disk);
+    int size = ctx->superblock.inode[inode_idx].used_size & 0x7F;
+    if (first < 0 || first >= size || count > size - first) {
+        // Name the first block the file lacks
+        fprintf(ctx->err, "Error: %.5s does not have block %d\n", name, first >= 0 && first < size ? size : first);
+        return -1;
     }
+    return inode_idx;
+}
+
+// Reads blocks [first, first + count) of a file into the first count blocks
+// of the buffer with one pread; the file is contiguous on disk
+void fs_read_range(FsContext *ctx, char name[5], int first, int count) {
+    int inode_idx = range_file_inode(ctx, name, first, count);
+    if (inode_idx == -1) return;
+
+    read_blocks(ctx, ctx->disk_fd, ctx->superblock.inode[inode_idx].start_block + first, count, ctx->buffer);
+    if (count > ctx->buffer_blocks) ctx->buffer_blocks = count;
+}
 
-    // Zero out inode
-    memset(&superblock.inode[inode_idx], 0, sizeof(Inode));
+// Writes the first count blocks of the buffer to blocks [first, first +
+// count) of a file with one pwrite. Nothing is written unless every block
+// is allocated.
+void fs_write_range(FsContext *ctx, char name[5], int first, int count) {
+    int inode_idx = range_file_inode(ctx, name, first, count);
+    if (inode_idx == -1) return;
 
-    // Write superblock back to disk
-    FILE *disk = fopen(current_disk, "r+b");
-    if (!disk) {
-        fprintf(stderr, "Error: Cannot open disk %s\n", current_disk);
+    int start = ctx->superblock.inode[inode_idx].start_block + first;
+    if (!blocks_are_used(ctx, start, start + count)) {
+        fprintf(ctx->err, "Error: Attempting to write to an unallocated block\n");
         return;
     }
-    write_block(disk, 0, &superblock);
-    fclose(disk);
+    // Superblock is unchanged, but still has to reach disk if it is stale there
+    mark_superblock_dirty(ctx);
+
+    write_blocks(ctx, ctx->disk_fd, start, count, ctx->buffer);
 }
 
-void fs_read(char name[5], int block_num) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Creates a file holding a host file's bytes, zero-padded to whole blocks.
+// The host file is read first, so a file is only created once its data is
+// at hand; the data then goes to the new extent in one pwrite.
+void fs_import(FsContext *ctx, char name[5], const char *host_path) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
-    int inode_idx = get_file_inode(name, current_dir_inode);
-    if (inode_idx == -1 || (superblock.inode[inode_idx].dir_parent & 0x80)) {
-        fprintf(stderr, "Error: File %-5.*s does not exist\n", 5, name);
+    int fd = openat(ctx->dir_fd, host_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(ctx->err, "Error: Cannot read %s\n", host_path);
+        if (fd != -1) close(fd);
+        return;
+    }
+    if (st.st_size == 0 || st.st_size > (off_t)(NUM_BLOCKS - 1) * BLOCK_SIZE) {
+        fprintf(ctx->err, "Error: %s must be 1 to %d KB to import\n", host_path, NUM_BLOCKS - 1);
+        close(fd);
         return;
     }
 
-    int size = superblock.inode[inode_idx].used_size & 0x7F;
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
+    int size = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char *data = calloc(size, BLOCK_SIZE);
+    ssize_t total = 0;
+    while (total < st.st_size) {
+        ssize_t n = read(fd, data + total, st.st_size - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    close(fd);
+    if (total < st.st_size) {
+        fprintf(ctx->err, "Error: Cannot read %s\n", host_path);
+        free(data);
         return;
     }
 
-    FILE *disk = fopen(current_disk, "r");
-    read_block(disk, superblock.inode[inode_idx].start_block + block_num, buffer);
-    fclose(disk);
+    int inode_idx = create_inode(ctx, name, size);
+    if (inode_idx != -1) {
+        write_blocks(ctx, ctx->disk_fd, ctx->superblock.inode[inode_idx].start_block, size, data);
+    }
+    free(data);
 }
 
-void fs_write(char name[5], int block_num) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+// Copies every block of a file to a host file, replacing it. Sizes are
+// whole blocks, so an imported file comes back zero-padded.
+void fs_export(FsContext *ctx, char name[5], const char *host_path) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
-    int inode_idx = get_file_inode(name, current_dir_inode);
-    if (inode_idx == -1 || (superblock.inode[inode_idx].dir_parent & 0x80)) {
-        fprintf(stderr, "Error: File %-5.*s does not exist\n", 5, name);
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1 || (ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: File %-5.*s does not exist\n", 5, name);
         return;
     }
 
-    int size = superblock.inode[inode_idx].used_size & 0x7F;
-    if (block_num < 0 || block_num >= size) {
-        fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
+    int fd = openat(ctx->dir_fd, host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(ctx->err, "Error: Cannot write %s\n", host_path);
         return;
     }
 
-    // Open disk for writing
-    FILE *disk = fopen(current_disk, "r+b");
-    if (!disk) {
-        fprintf(stderr, "Error: Cannot open disk %s\n", current_disk);
-        return;
+    int size = ctx->superblock.inode[inode_idx].used_size & 0x7F;
+    char *data = malloc((size_t)size * BLOCK_SIZE);
+    read_blocks(ctx, ctx->disk_fd, ctx->superblock.inode[inode_idx].start_block, size, data);
+    size_t total = 0;
+    while (total < (size_t)size * BLOCK_SIZE) {
+        ssize_t n = write(fd, data + total, (size_t)size * BLOCK_SIZE - total);
+        if (n <= 0) break;
+        total += n;
     }
-
-    // Calculate actual block number
-    int actual_block = superblock.inode[inode_idx].start_block + block_num;
-
-    // Make sure block is marked as used in free block list
-    int byte_idx = actual_block / 8;
-    int bit_idx = actual_block % 8;
-    if (!(superblock.free_block_list[byte_idx] & (1 << bit_idx))) {
-        fprintf(stderr, "Error: Attempting to write to an unallocated block\n");
-        fclose(disk);
-        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_dev == ctx->current_dev && st.st_ino == ctx->current_ino) {
+        block_cache_clear(ctx);  // Rewrote the mounted image behind the cache
     }
-    // Write updated superblock first
-    write_block(disk, 0, &superblock);
+    if (total < (size_t)size * BLOCK_SIZE || close(fd) == -1) {
+        fprintf(ctx->err, "Error: Cannot write %s\n", host_path);
+    }
+    free(data);
+}
 
-    // Write buffer content to the specified block
-    write_block(disk, actual_block, buffer);
-    fclose(disk);
+static void fill_buffer(FsContext *ctx, const char *data, size_t len) {
+    memset(ctx->buffer, 0, BLOCK_SIZE);
+    memcpy(ctx->buffer, data, len);
 }
 
-void fs_buff(char buff[1024]) {
-    memset(buffer, 0, BLOCK_SIZE); 
-    memcpy(buffer, buff, strlen(buff)); 
+void fs_buff(FsContext *ctx, char buff[1024]) {
+    fill_buffer(ctx, buff, strlen(buff));
 }
 
-void fs_ls(void) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+void fs_ls(FsContext *ctx) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
     // Print current directory (.)
-    int current_children = 2;
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode) {
-            current_children++;
-        }
-    }
-    printf("%-5s %3d\n", ".", current_children);
+    fprintf(ctx->out, "%-5s %3d\n", ".", 2 + child_count(ctx, ctx->current_dir_inode));
 
     // Print parent directory (..)
-    int parent_inode = current_dir_inode == 0 ? 0 :
-                      (superblock.inode[current_dir_inode].dir_parent & 0x7F);
-    int parent_children = 2;
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == parent_inode) {
-            parent_children++;
-        }
-    }
-    printf("%-5s %3d\n", "..", parent_children);
+    int parent_inode = ctx->current_dir_inode == ROOT_INODE ? ROOT_INODE :
+                      (ctx->superblock.inode[ctx->current_dir_inode].dir_parent & 0x7F);
+    fprintf(ctx->out, "%-5s %3d\n", "..", 2 + child_count(ctx, parent_inode));
 
     // Print all other entries
-    for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&
-            (superblock.inode[i].dir_parent & 0x7F) == current_dir_inode) {
-            if (superblock.inode[i].dir_parent & 0x80) {  // Directory
-                int dir_children = 2;
-                for (int j = 0; j < NUM_INODES; j++) {
-                    if ((superblock.inode[j].used_size & 0x80) &&
-                        (superblock.inode[j].dir_parent & 0x7F) == i) {
-                        dir_children++;
-                    }
-                }
-                printf("%-5.*s %3d\n", 5, superblock.inode[i].name, dir_children);
-            } else {  // File
-                printf("%-5.*s %3d KB\n", 5, superblock.inode[i].name, superblock.inode[i].used_size & 0x7F);
-            }
+    for (int i = next_child(ctx, ctx->current_dir_inode, 0); i != -1;
+         i = next_child(ctx, ctx->current_dir_inode, i + 1)) {
+        if (ctx->superblock.inode[i].dir_parent & 0x80) {  // Directory
+            fprintf(ctx->out, "%-5.*s %3d\n", 5, ctx->superblock.inode[i].name, 2 + child_count(ctx, i));
+        } else {  // File
+            fprintf(ctx->out, "%-5.*s %3d KB\n", 5, ctx->superblock.inode[i].name, ctx->superblock.inode[i].used_size & 0x7F);
         }
     }
 }
 
-void fs_resize(char name[5], int new_size) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+void fs_resize(FsContext *ctx, char name[5], int new_size) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
-    int inode_idx = get_file_inode(name, current_dir_inode);
-    if (inode_idx == -1 || (superblock.inode[inode_idx].dir_parent & 0x80)) {
-        fprintf(stderr, "Error: File %-5.*s does not exist\n", 5, name);
+    int inode_idx = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (inode_idx == -1 || (ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: File %-5.*s does not exist\n", 5, name);
         return;
     }
 
-    int current_size = superblock.inode[inode_idx].used_size & 0x7F;
-    int current_start = superblock.inode[inode_idx].start_block;
-
-    // Open disk once for all operations
-    FILE *disk = fopen(current_disk, "r+b");
-    if (!disk) {
-        fprintf(stderr, "Error: Cannot open disk %s\n", current_disk);
-        return;
-    }
+    int current_size = ctx->superblock.inode[inode_idx].used_size & 0x7F;
+    int current_start = ctx->superblock.inode[inode_idx].start_block;
 
     if (new_size > current_size) {
         // Check if we can expand in place
-        int can_expand = 1;
-        for (int i = current_start + current_size;
-             i < current_start + new_size && i < NUM_BLOCKS; i++) {
-            int byte_idx = i / 8;
-            int bit_idx = i % 8;
-            if (superblock.free_block_list[byte_idx] & (1 << bit_idx)) {
-                can_expand = 0;
-                break;
-            }
-        }
-
-        if (can_expand) {
+        if (blocks_are_free(ctx, current_start + current_size, current_start + new_size)) {
             // Mark new blocks as used
-            mark_blocks(current_start + current_size,
+            mark_blocks(ctx, current_start + current_size,
                        new_size - current_size, 1);
+            ctx->superblock.inode[inode_idx].used_size = 0x80 | (new_size & 0x7F);
+            mark_superblock_dirty(ctx);
         } else {
             // Try to find new location
-            int new_start = find_contiguous_blocks(new_size);
+            int new_start = find_contiguous_blocks(ctx, new_size);
             if (new_start == -1) {
-                fprintf(stderr, "Error: File %s cannot expand to size %d\n",
+                fprintf(ctx->err, "Error: File %s cannot expand to size %d\n",
                         name, new_size);
-                fclose(disk);
                 return;
             }
 
             // Copy data to new location
             uint8_t temp_buffer[BLOCK_SIZE];
             for (int i = 0; i < current_size; i++) {
-                read_block(disk, current_start + i, temp_buffer);
-                write_block(disk, new_start + i, temp_buffer);
-            }
-
-            // Zero out old blocks
-            memset(temp_buffer, 0, BLOCK_SIZE);
-            for (int i = 0; i < current_size; i++) {
-                write_block(disk, current_start + i, temp_buffer);
+                read_block(ctx, ctx->disk_fd, current_start + i, temp_buffer);
+                write_block(ctx, ctx->disk_fd, new_start + i, temp_buffer);
             }
 
             // Update block allocation
-            mark_blocks(current_start, current_size, 0);
-            mark_blocks(new_start, new_size, 1);
-            superblock.inode[inode_idx].start_block = new_start;
+            mark_blocks(ctx, current_start, current_size, 0);
+            mark_blocks(ctx, new_start, new_size, 1);
+            ctx->superblock.inode[inode_idx].start_block = new_start;
+            ctx->superblock.inode[inode_idx].used_size = 0x80 | (new_size & 0x7F);
+            mark_superblock_dirty(ctx);
+
+            // Zero out old blocks
+            zero_freed_blocks(ctx, current_start, current_size);
         }
     } else if (new_size < current_size) {
-        // Zero out freed blocks
-        uint8_t zero_block[BLOCK_SIZE] = {0};
-        for (int i = new_size; i < current_size; i++) {
-            write_block(disk, current_start + i, zero_block);
-        }
-
         // Update block allocation
-        mark_blocks(current_start + new_size,
+        mark_blocks(ctx, current_start + new_size,
                    current_size - new_size, 0);
-    }
+        ctx->superblock.inode[inode_idx].used_size = 0x80 | (new_size & 0x7F);
+        mark_superblock_dirty(ctx);
 
-    // Update size in inode
-    superblock.inode[inode_idx].used_size = 0x80 | (new_size & 0x7F);
+        // Zero out freed blocks
+        zero_freed_blocks(ctx, current_start + new_size, current_size - new_size);
+    }
+}
 
-    // Write superblock back to disk
-    write_block(disk, 0, &superblock);
-    fclose(disk);
+// Defrag plan entry: one file, ordered by start block (then inode, like a stable sort)
+typedef struct {
+    int inode_idx;
+    int start_block;
+    int size;
+} FileInfo;
+
+static int compare_file_start(const void *a, const void *b) {
+    const FileInfo *fa = a, *fb = b;
+    if (fa->start_block != fb->start_block) return fa->start_block - fb->start_block;
+    return fa->inode_idx - fb->inode_idx;
 }
 
-void fs_defrag(void) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+void fs_defrag(FsContext *ctx) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
     // Create sorted array of files
-    typedef struct {
-        int inode_idx;
-        int start_block;
-        int size;
-    } FileInfo;
-
     FileInfo files[NUM_INODES];
     int num_files = 0;
 
     for (int i = 0; i < NUM_INODES; i++) {
-        if ((superblock.inode[i].used_size & 0x80) &&
-            !(superblock.inode[i].dir_parent & 0x80)) {
+        if ((ctx->superblock.inode[i].used_size & 0x80) &&
+            !(ctx->superblock.inode[i].dir_parent & 0x80)) {
             files[num_files].inode_idx = i;
-            files[num_files].start_block = superblock.inode[i].start_block;
-            files[num_files].size = superblock.inode[i].used_size & 0x7F;
+            files[num_files].start_block = ctx->superblock.inode[i].start_block;
+            files[num_files].size = ctx->superblock.inode[i].used_size & 0x7F;
             num_files++;
         }
     }
+    qsort(files, num_files, sizeof(FileInfo), compare_file_start);
 
-    // Sort files by start block
-    for (int i = 0; i < num_files - 1; i++) {
-        for (int j = 0; j < num_files - i - 1; j++) {
-            if (files[j].start_block > files[j + 1].start_block) {
-                FileInfo temp = files[j];
-                files[j] = files[j + 1];
-                files[j + 1] = temp;
-            }
+    // Plan the compaction: each file slides down to the next free block, and
+    // only files that are not already there move. All moves happen inside
+    // one window spanning their old and new locations.
+    int new_start[NUM_INODES];
+    int next_free = 1;  // Start after superblock
+    int window_start = -1, window_end = -1;
+    for (int i = 0; i < num_files; i++) {
+        new_start[i] = next_free;
+        if (files[i].start_block != next_free) {
+            int lo = files[i].start_block < next_free ? files[i].start_block : next_free;
+            int hi = files[i].start_block > next_free ? files[i].start_block : next_free;
+            hi += files[i].size;
+            if (window_start == -1 || lo < window_start) window_start = lo;
+            if (hi > window_end) window_end = hi;
         }
+        next_free += files[i].size;
     }
 
-    // Move files toward beginning
-    int next_free = 1;  // Start after superblock
-    FILE *disk = fopen(current_disk, "r+b");
+    // Read the window once, apply the moves in memory in start order, then
+    // write back the blocks the moves touched
+    int window_blocks = window_end - window_start;
+    char *window = NULL;
+    uint8_t *touched = NULL;
+    if (window_start != -1) {
+        window = calloc(window_blocks, BLOCK_SIZE);
+        touched = calloc(window_blocks, 1);
+        read_blocks(ctx, ctx->disk_fd, window_start, window_blocks, window);
+
+        for (int i = 0; i < num_files; i++) {
+            if (files[i].start_block == new_start[i]) continue;
+            int from = files[i].start_block - window_start;
+            int to = new_start[i] - window_start;
+            int size = files[i].size;
+
+            memmove(window + to * BLOCK_SIZE, window + from * BLOCK_SIZE, size * BLOCK_SIZE);
+            // Zero the part of the old location the file no longer covers
+            for (int j = from; j < from + size; j++) {
+                if (j < to || j >= to + size) {
+                    memset(window + j * BLOCK_SIZE, 0, BLOCK_SIZE);
+                }
+            }
+            memset(touched + (from < to ? from : to), 1, size + (from < to ? to - from : from - to));
 
+            ctx->superblock.inode[files[i].inode_idx].start_block = new_start[i];
+        }
+    }
+
+    // Update free block list
+    memset(ctx->superblock.free_block_list, 0, 16);  // Mark all blocks as free
+    ctx->superblock.free_block_list[0] = BLOCK_BIT(0);  // Mark superblock as used
+    ctx->free_extents_valid = 0;
     for (int i = 0; i < num_files; i++) {
-        if (files[i].start_block != next_free) {
-            // Read file data
-            char *file_data = malloc(files[i].size * BLOCK_SIZE);
-            // Move each block of the file
-            for (int j = 0; j < files[i].size; j++) {
-                read_block(disk, files[i].start_block + j, file_data + j * BLOCK_SIZE);
-            }
+        mark_blocks(ctx, ctx->superblock.inode[files[i].inode_idx].start_block,
+                   files[i].size, 1);
+    }
 
-            // Zero out old blocks
-            char zero_block[BLOCK_SIZE] = {0};
-            for (int j = 0; j < files[i].size; j++) {
-                write_block(disk, files[i].start_block + j, zero_block);
+    mark_superblock_dirty(ctx);
+
+    if (window && ctx->journal) {
+        // The moves overwrite blocks the old superblock still points at, so
+        // they are committed together with the new one
+        JournalExtent *runs = malloc(window_blocks * sizeof(JournalExtent));
+        int num_runs = 0;
+        for (int j = 0; j < window_blocks; ) {
+            if (!touched[j]) {
+                j++;
+                continue;
+            }
+            int run = j;
+            while (run < window_blocks && touched[run]) run++;
+            runs[num_runs++] = (JournalExtent){window_start + j, run - j, window + j * BLOCK_SIZE};
+            j = run;
+        }
+        write_transaction(ctx, runs, num_runs);
+        free(runs);
+    } else if (window) {
+        // With hole punching, runs of zero blocks (mostly the space the
+        // compaction freed) are punched rather than written
+        for (int j = 0; j < window_blocks; ) {
+            if (!touched[j]) {
+                j++;
+                continue;
+            }
+            int zero = ctx->punch_holes && block_is_zero(window + j * BLOCK_SIZE);
+            int run = j + 1;
+            while (run < window_blocks && touched[run] &&
+                   (ctx->punch_holes && block_is_zero(window + run * BLOCK_SIZE)) == zero) {
+                run++;
             }
+            if (zero) {
+                zero_blocks(ctx, ctx->disk_fd, window_start + j, run - j);
+            } else {
+                write_blocks(ctx, ctx->disk_fd, window_start + j, run - j, window + j * BLOCK_SIZE);
+            }
+            j = run;
+        }
+    }
+    free(touched);
+    free(window);
+}
 
-            // Write to new location
-            for (int j = 0; j < files[i].size; j++) {
-                write_block(disk, next_free + j,
-                          file_data + j * BLOCK_SIZE);
+// Move the file right after the first hole that can hold it down into
+// it. A hole shorter than the file after it is skipped: the new location
+// would overlap the old one, and the first blocks written would overwrite
+// data the superblock on disk still points at. The data is copied and the
+// superblock written before the old blocks are zeroed, so the image on
+// disk is consistent between moves. Returns 1 after a move, 0 if the move
+// waits for more credit, and -1 if no file can move.
+static int defrag_move_one(FsContext *ctx) {
+    if (!ctx->free_extents_valid) rebuild_free_extents(ctx);
+
+    int new_start = -1, old_start = -1, inode_idx = -1, size = 0;
+    for (int hole = 0; hole < ctx->num_free_extents && inode_idx == -1; hole++) {
+        new_start = ctx->free_extents[hole].start;
+        old_start = new_start + ctx->free_extents[hole].length;
+        if (old_start >= NUM_BLOCKS) break;  // Only free space after it
+        for (int i = 0; i < NUM_INODES; i++) {
+            if ((ctx->superblock.inode[i].used_size & 0x80) &&
+                !(ctx->superblock.inode[i].dir_parent & 0x80) &&
+                ctx->superblock.inode[i].start_block == old_start) {
+                size = ctx->superblock.inode[i].used_size & 0x7F;
+                // A block not owned by a file is left alone
+                if (size <= ctx->free_extents[hole].length && old_start + size <= NUM_BLOCKS) inode_idx = i;
+                break;
             }
+        }
+    }
+    if (inode_idx == -1) return -1;
+    if (size > ctx->defrag_credit) return 0;
 
-            free(file_data);
+    char *data = malloc(size * BLOCK_SIZE);
+    read_blocks(ctx, ctx->disk_fd, old_start, size, data);
 
-            // Update inode
-            superblock.inode[files[i].inode_idx].start_block = next_free;
-        }
-        next_free += files[i].size;
+    mark_blocks(ctx, old_start, size, 0);
+    mark_blocks(ctx, new_start, size, 1);
+    ctx->superblock.inode[inode_idx].start_block = new_start;
+    mark_superblock_dirty(ctx);
+    JournalExtent moved = {new_start, size, data};
+    write_transaction(ctx, &moved, 1);
+
+    zero_blocks(ctx, ctx->disk_fd, old_start, size);
+    free(data);
+
+    ctx->defrag_credit -= size;
+    return 1;
+}
+
+static void defrag_step(FsContext *ctx) {
+    if (ctx->defrag_budget <= 0 || !ctx->current_disk) return;
+
+    ctx->defrag_credit += ctx->defrag_budget;
+    int moved;
+    while ((moved = defrag_move_one(ctx)) == 1) {
     }
 
-    // Update free block list
-    memset(superblock.free_block_list, 0, 16);  // Mark all blocks as free
-    superblock.free_block_list[0] = 1;  // Mark superblock as used
-    for (int i = 0; i < num_files; i++) {
-        mark_blocks(superblock.inode[files[i].inode_idx].start_block,
-                   files[i].size, 1);
+    // Nothing to bank once no file can move (the disk is compact, or every
+    // hole is shorter than the file after it)
+    if (moved == -1) ctx->defrag_credit = 0;
+}
+
+void fs_frag(FsContext *ctx) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
+        return;
+    }
+
+    if (!ctx->free_extents_valid) rebuild_free_extents(ctx);
+    int free_blocks = 0;
+    int largest = 0;
+    for (int i = 0; i < ctx->num_free_extents; i++) {
+        free_blocks += ctx->free_extents[i].length;
+        if (ctx->free_extents[i].length > largest) largest = ctx->free_extents[i].length;
     }
 
-    // Write superblock back to disk
-    write_block(disk, 0, &superblock);
-    fclose(disk);
+    // External fragmentation: share of free space outside the largest extent
+    double fragmentation = free_blocks ? 1.0 - (double)largest / free_blocks : 0.0;
+    fprintf(ctx->out, "%-9s %3d\n", "extents", ctx->num_free_extents);
+    fprintf(ctx->out, "%-9s %3d KB\n", "largest", largest);
+    fprintf(ctx->out, "%-9s %3d KB\n", "free", free_blocks);
+    fprintf(ctx->out, "%-9s %.3f\n", "fragment", fragmentation);
 }
 
-void fs_cd(char name[5]) {
-    if (!current_disk) {
-        fprintf(stderr, "Error: No file system is mounted\n");
+void fs_cd(FsContext *ctx, char name[5]) {
+    if (!ctx->current_disk) {
+        fprintf(ctx->err, "Error: No file system is mounted\n");
         return;
     }
 
@@ -633,179 +2385,564 @@ void fs_cd(char name[5]) {
     }
 
     if (strcmp(name, "..") == 0) {
-        if (current_dir_inode != 0) {  // Not root directory
-            int parent = superblock.inode[current_dir_inode].dir_parent & 0x7F;
-            if (parent != 127) {  // Not root
-                current_dir_inode = parent;
-            }
+        if (ctx->current_dir_inode != ROOT_INODE) {  // Not root directory
+            ctx->current_dir_inode = ctx->superblock.inode[ctx->current_dir_inode].dir_parent & 0x7F;
         }
         return;
     }
 
     // Find directory in current directory
-    int dir_inode = get_file_inode(name, current_dir_inode);
-    if (dir_inode == -1 || !(superblock.inode[dir_inode].dir_parent & 0x80)) {
-        fprintf(stderr, "Error: Directory %-5.*s does not exist\n", 5, name);
+    int dir_inode = get_file_inode(ctx, name, ctx->current_dir_inode);
+    if (dir_inode == -1 || !(ctx->superblock.inode[dir_inode].dir_parent & 0x80)) {
+        fprintf(ctx->err, "Error: Directory %-5.*s does not exist\n", 5, name);
         return;
     }
 
-    current_dir_inode = dir_inode;
+    ctx->current_dir_inode = dir_inode;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <command_file>\n", argv[0]);
-        return 1;
+// Looks up the directories named by path[0..len), starting at root when it
+// begins with '/' and at the current directory otherwise. Components are
+// 1 to 5 characters; "." and ".." work as in Y. Returns the inode of the
+// last directory, or -1 after reporting the first one that does not exist.
+static int resolve_directory(FsContext *ctx, const char *path, size_t len) {
+    int absolute = len > 0 && path[0] == '/';
+    int base = absolute ? ROOT_INODE : ctx->current_dir_inode;
+
+    Dentry *dentry = NULL;
+    if (len < DENTRY_PATH_MAX) {
+        dentry = &ctx->dentry_cache[(crc32c(path, len) ^ (uint32_t)base) % DENTRY_SLOTS];
+        if (dentry->generation == ctx->namespace_generation && dentry->base == base &&
+            strncmp(dentry->path, path, len) == 0 && dentry->path[len] == '\0') {
+            ctx->dentry_hits++;
+            return dentry->dir_inode;
+        }
+    }
+    ctx->dentry_misses++;
+
+    int dir = base;
+    for (size_t pos = absolute; pos < len;) {
+        size_t end = pos;
+        while (end < len && path[end] != '/') end++;
+        size_t n = end - pos;
+        if (n == 2 && path[pos] == '.' && path[pos + 1] == '.') {
+            if (dir != ROOT_INODE) {  // Not root directory
+                dir = ctx->superblock.inode[dir].dir_parent & 0x7F;
+            }
+        } else if (!(n == 1 && path[pos] == '.')) {
+            char name[5] = {0};
+            memcpy(name, path + pos, n);
+            int inode_idx = get_file_inode(ctx, name, dir);
+            if (inode_idx == -1 || !(ctx->superblock.inode[inode_idx].dir_parent & 0x80)) {
+                fprintf(ctx->err, "Error: Directory %-5.*s does not exist\n", (int)n, path + pos);
+                return -1;
+            }
+            dir = inode_idx;
+        }
+        pos = end + 1;
     }
 
-    FILE *cmd_file = fopen(argv[1], "r");
-    if (!cmd_file) {
-        fprintf(stderr, "Error: Cannot open command file %s\n", argv[1]);
-        return 1;
+    if (dentry) {
+        dentry->generation = ctx->namespace_generation;
+        dentry->base = base;
+        dentry->dir_inode = dir;
+        memcpy(dentry->path, path, len);
+        dentry->path[len] = '\0';
     }
+    return dir;
+}
 
-    char line[1024];
-    int line_num = 0;
-    
-    while (fgets(line, sizeof(line), cmd_file)) {
-        line_num++;
-        line[strcspn(line, "\n")] = 0; // Remove newline
-        if (line[0] == '\0') continue; // Skip empty lines
-
-        char cmd = line[0];
-        char args[1024];
-        
-        if (strlen(line) > 2) {
-            strcpy(args, line + 2);
-        } else {
-            args[0] = '\0';
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record_command(FsContext *ctx, char op, uint64_t ns) {
+    CommandStats *cs = &ctx->command_stats[op & 0x7F];
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    cs->count++;
+    cs->total_ns += ns;
+    cs->histogram[bucket]++;
+}
+
+// Writes the stats report as one JSON object
+void fs_write_stats(FsContext *ctx, FILE *out) {
+    fprintf(out, "{\"commands\": {");
+    const char *sep = "";
+    for (int op = 0; op < 128; op++) {
+        const CommandStats *cs = &ctx->command_stats[op];
+        if (cs->count == 0) continue;
+        fprintf(out, "%s\"%c\": {\"count\": %lu, \"total_ns\": %llu, \"latency_log2_ns\": [",
+                sep, op, cs->count, (unsigned long long)cs->total_ns);
+        const char *bsep = "";
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            if (cs->histogram[b] == 0) continue;
+            fprintf(out, "%s[%llu, %lu]", bsep, 1ULL << b, cs->histogram[b]);
+            bsep = ", ";
         }
+        fprintf(out, "]}");
+        sep = ", ";
+    }
+    fprintf(out, "}, \"command_errors\": %lu, ", ctx->command_errors);
+    fprintf(out, "\"io\": {\"open\": %lu, \"pread\": %lu, \"pwrite\": %lu, "
+            "\"bytes_read\": %llu, \"bytes_written\": %llu, \"superblock_writes\": %lu, "
+            "\"hole_punches\": %lu, \"bytes_punched\": %llu, \"fsyncs\": %lu}, ",
+            ctx->io_stats.opens, ctx->io_stats.preads, ctx->io_stats.pwrites,
+            (unsigned long long)ctx->io_stats.bytes_read, (unsigned long long)ctx->io_stats.bytes_written,
+            ctx->io_stats.superblock_writes, ctx->io_stats.hole_punches,
+            (unsigned long long)ctx->io_stats.bytes_punched, ctx->io_stats.fsyncs);
+    fprintf(out, "\"aio\": {\"engine\": \"%s\", \"batches\": %lu, \"writes\": %lu}, ",
+            !ctx->aio ? "off" : ctx->aio->engine == AIO_URING ? "io_uring" : "threads",
+            ctx->io_stats.aio_batches, ctx->io_stats.aio_writes);
+    fprintf(out, "\"block_cache\": {\"size\": %d, \"hits\": %lu, \"misses\": %lu, \"readahead\": %lu}, ",
+            ctx->block_cache_size, ctx->block_cache_hits, ctx->block_cache_misses, ctx->block_cache_readahead);
+    fprintf(out, "\"dentry_cache\": {\"hits\": %lu, \"misses\": %lu}, ",
+            ctx->dentry_hits, ctx->dentry_misses);
+    fprintf(out, "\"journal\": {\"commits\": %lu, \"bytes\": %llu, \"replayed\": %lu}, ",
+            ctx->io_stats.journal_commits, (unsigned long long)ctx->io_stats.journal_bytes,
+            ctx->io_stats.journal_replays);
+    fprintf(out, "\"mount_cache\": {\"hits\": %lu, \"checksum_hits\": %lu, \"misses\": %lu, "
+            "\"table_switches\": %lu}}\n",
+            ctx->mount_cache_hits, ctx->mount_cache_checksum_hits, ctx->mount_cache_misses,
+            ctx->mount_table_switches);
+}
 
-        switch (cmd) {
-            case 'M': {  // Mount
-                char disk_name[256];
-                if (sscanf(args, "%s", disk_name) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
-                }
-                fs_mount(disk_name);
-                break;
-            }
+void fs_merge_stats(FsContext *ctx, const FsContext *from) {
+    for (int op = 0; op < 128; op++) {
+        CommandStats *cs = &ctx->command_stats[op];
+        const CommandStats *add = &from->command_stats[op];
+        cs->count += add->count;
+        cs->total_ns += add->total_ns;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) cs->histogram[b] += add->histogram[b];
+    }
+    ctx->command_errors += from->command_errors;
+    ctx->io_stats.opens += from->io_stats.opens;
+    ctx->io_stats.preads += from->io_stats.preads;
+    ctx->io_stats.pwrites += from->io_stats.pwrites;
+    ctx->io_stats.bytes_read += from->io_stats.bytes_read;
+    ctx->io_stats.bytes_written += from->io_stats.bytes_written;
+    ctx->io_stats.superblock_writes += from->io_stats.superblock_writes;
+    ctx->io_stats.hole_punches += from->io_stats.hole_punches;
+    ctx->io_stats.bytes_punched += from->io_stats.bytes_punched;
+    ctx->io_stats.journal_commits += from->io_stats.journal_commits;
+    ctx->io_stats.journal_bytes += from->io_stats.journal_bytes;
+    ctx->io_stats.journal_replays += from->io_stats.journal_replays;
+    ctx->io_stats.fsyncs += from->io_stats.fsyncs;
+    ctx->io_stats.aio_batches += from->io_stats.aio_batches;
+    ctx->io_stats.aio_writes += from->io_stats.aio_writes;
+    ctx->block_cache_hits += from->block_cache_hits;
+    ctx->block_cache_misses += from->block_cache_misses;
+    ctx->block_cache_readahead += from->block_cache_readahead;
+    ctx->dentry_hits += from->dentry_hits;
+    ctx->dentry_misses += from->dentry_misses;
+    ctx->mount_cache_hits += from->mount_cache_hits;
+    ctx->mount_cache_checksum_hits += from->mount_cache_checksum_hits;
+    ctx->mount_cache_misses += from->mount_cache_misses;
+    ctx->mount_table_switches += from->mount_table_switches;
+}
 
-            case 'C':  // Create
-                {
-                    char name[6];  // Extra byte for null terminator
-                    int size;
-                    if (sscanf(line, "C %5s %d", name, &size) != 2 || 
-                        size < 0 || size > 127 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_create(name, size);
-                }
-                break;
+void fs_write_mount_cache_stats(FsContext *ctx, FILE *out) {
+    unsigned long fast = ctx->mount_table_switches + ctx->mount_cache_hits + ctx->mount_cache_checksum_hits;
+    unsigned long mounts = fast + ctx->mount_cache_misses;
+    fprintf(out, "mount_cache table_switches=%lu hits=%lu checksum_hits=%lu misses=%lu hit_rate=%.3f\n",
+            ctx->mount_table_switches, ctx->mount_cache_hits, ctx->mount_cache_checksum_hits,
+            ctx->mount_cache_misses, mounts ? (double)fast / mounts : 0.0);
+}
 
-            case 'D':  // Delete
-                {
-                    char name[6];
-                    if (sscanf(line, "D %5s", name) != 1 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_delete(name);
-                }
-                break;
+void fs_write_block_cache_stats(FsContext *ctx, FILE *out) {
+    if (!ctx->block_cache_size) return;
+    unsigned long reads = ctx->block_cache_hits + ctx->block_cache_misses;
+    fprintf(out, "block_cache size=%d hits=%lu misses=%lu readahead=%lu hit_rate=%.3f\n",
+            ctx->block_cache_size, ctx->block_cache_hits, ctx->block_cache_misses,
+            ctx->block_cache_readahead, reads ? (double)ctx->block_cache_hits / reads : 0.0);
+}
 
-            case 'R':  // Read
-                {
-                    char name[6];
-                    int block;
-                    if (sscanf(line, "R %5s %d", name, &block) != 2 || 
-                        block < 0 || block > 126 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_read(name, block);
-                }
-                break;
+// Command scanner. Lines are views into the command file and are tokenized
+// in place; each helper mirrors the sscanf conversion the grammar was
+// defined with, so malformed input is rejected exactly as before.
+typedef struct {
+    const char *pos;
+    const char *end;
+} Scanner;
 
-            case 'W':  // Write
-                {
-                    char name[6];
-                    int block;
-                    if (sscanf(line, "W %5s %d", name, &block) != 2 || 
-                        block < 0 || block > 126 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_write(name, block);
-                }
-                break;
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
 
-            case 'B':  // Buffer
-                {
-                    if (strlen(line) < 2) {  // Just "B" 
-                        memset(buffer, 0, 1024);
-                    } else {
-                        char *buffer_content = line + 2;  // Skip "B "
-                        if (strlen(buffer_content) > 1024) {
-                            fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                            continue;
-                        }
-                        fs_buff(buffer_content);
-                    }
-                }
-                break;
+static void skip_spaces(Scanner *sc) {
+    while (sc->pos < sc->end && is_space(*sc->pos)) sc->pos++;
+}
 
-            case 'L':  // List
-                if (strlen(line) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
-                }
-                fs_ls();
-                break;
+// " %Ns": up to max non-space characters, NUL-terminated into out
+static int scan_word(Scanner *sc, char *out, size_t max) {
+    skip_spaces(sc);
+    size_t len = 0;
+    while (sc->pos < sc->end && !is_space(*sc->pos) && len < max) {
+        out[len++] = *sc->pos++;
+    }
+    out[len] = '\0';
+    return len > 0;
+}
 
-            case 'E':  // Resize
-                {
-                    char name[6];
-                    int new_size;
-                    if (sscanf(line, "E %5s %d", name, &new_size) != 2 || 
-                        new_size <= 0 || new_size > 127 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_resize(name, new_size);
-                }
-                break;
+// " %d": optional sign and digits, saturating like strtol before the
+// narrowing store into an int
+static int scan_int(Scanner *sc, int *value) {
+    skip_spaces(sc);
+    int negative = 0;
+    if (sc->pos < sc->end && (*sc->pos == '+' || *sc->pos == '-')) {
+        negative = *sc->pos++ == '-';
+    }
+    if (sc->pos >= sc->end || *sc->pos < '0' || *sc->pos > '9') return 0;
+
+    unsigned long magnitude = 0;
+    int overflow = 0;
+    while (sc->pos < sc->end && *sc->pos >= '0' && *sc->pos <= '9') {
+        unsigned long digit = *sc->pos++ - '0';
+        if (magnitude > (~0UL - digit) / 10) overflow = 1;
+        else magnitude = magnitude * 10 + digit;
+    }
+    long result;
+    if (negative) {
+        result = overflow || magnitude > (unsigned long)LONG_MAX + 1 ? LONG_MIN : -(long)magnitude;
+    } else {
+        result = overflow || magnitude > LONG_MAX ? LONG_MAX : (long)magnitude;
+    }
+    *value = (int)result;
+    return 1;
+}
 
-            case 'O':  // Defragment
-                if (strlen(line) != 1) {
-                    fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                    continue;
-                }
-                fs_defrag();
+// Name argument: a zero-padded 5-byte name
+static int scan_name(Scanner *sc, char name[6]) {
+    memset(name, 0, 6);
+    return scan_word(sc, name, 5);
+}
+
+// A name argument, which may also be a path: a word containing '/' names
+// an entry through directories ("a/b/file", "/a/file"), and the command
+// runs in the entry's directory
+typedef struct {
+    char name[6];      // Zero-padded last component
+    char path[1024];   // The whole word if it is a path, else empty
+    int saved_dir;     // Current directory to return to
+    int saved_dir_used;
+} Target;
+
+// Checks that every component of a path is 1 to 5 characters. A directory
+// argument may also end in '/' or be just "/".
+static int path_is_wellformed(const char *path, int directory) {
+    const char *p = path + (path[0] == '/');
+    if (*p == '\0') return directory;
+    for (;;) {
+        size_t n = strcspn(p, "/");
+        if (n == 0 || n > 5) return 0;
+        p += n;
+        if (*p == '\0') return 1;
+        if (*++p == '\0') return directory;
+    }
+}
+
+// Name or path argument; a word without '/' is scanned like " %5s"
+static int scan_target(Scanner *sc, Target *target, int directory) {
+    skip_spaces(sc);
+    const char *p = sc->pos;
+    while (p < sc->end && !is_space(*p) && *p != '/') p++;
+    target->path[0] = '\0';
+    if (p == sc->end || *p != '/') return scan_name(sc, target->name);
+
+    if (!scan_word(sc, target->path, sizeof(target->path) - 1) ||
+        !path_is_wellformed(target->path, directory)) {
+        return 0;
+    }
+    const char *leaf = strrchr(target->path, '/') + 1;
+    memset(target->name, 0, sizeof(target->name));
+    memcpy(target->name, leaf, strlen(leaf));
+    return 1;
+}
+
+// Switches to the directory holding a path argument's entry; returns 0
+// after reporting a missing directory, in which case the command is skipped
+static int inode_in_use(FsContext *ctx, int inode_idx) {
+    return (ctx->used_inodes[inode_idx / 64] >> (inode_idx % 64)) & 1;
+}
+
+static int enter_target(FsContext *ctx, Target *target) {
+    target->saved_dir = ctx->current_dir_inode;
+    target->saved_dir_used = inode_in_use(ctx, target->saved_dir);
+    if (!target->path[0] || !ctx->current_disk) return 1;  // Unmounted: the command reports it
+
+    size_t len = strrchr(target->path, '/') - target->path;
+    int dir = resolve_directory(ctx, target->path, len ? len : 1);  // "/name" is in root
+    if (dir == -1) return 0;
+    ctx->current_dir_inode = dir;
+    return 1;
+}
+
+static void leave_target(FsContext *ctx, const Target *target) {
+    int dir = target->saved_dir;
+    // A delete through a path can remove the directory the command ran from
+    if (dir != ROOT_INODE && target->saved_dir_used && !inode_in_use(ctx, dir)) dir = ROOT_INODE;
+    ctx->current_dir_inode = dir;
+}
+
+// Disk name argument of an M line
+static int scan_mount(const char *line, size_t len, char disk_name[1024]) {
+    Scanner args = {len > 2 ? line + 2 : line + len, line + len};
+    return scan_word(&args, disk_name, 1023);
+}
+
+// Executes one command line; returns 0 if it is malformed
+static int dispatch_command(FsContext *ctx, const char *line, size_t len) {
+    Scanner sc = {line + 1, line + len};  // The opcode itself has matched
+    Target target;
+    int value;
+
+    switch (line[0]) {
+        case 'M': {  // Mount
+            char disk_name[1024];
+            if (!scan_mount(line, len, disk_name)) break;
+            fs_mount(ctx, disk_name);
+            end_command(ctx);
+            return 1;
+        }
+
+        case 'C':  // Create
+            if (!scan_target(&sc, &target, 0) || !scan_int(&sc, &value) || value < 0 || value > 127) break;
+            if (enter_target(ctx, &target)) {
+                fs_create(ctx, target.name, value);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'D':  // Delete
+            if (!scan_target(&sc, &target, 0)) break;
+            if (enter_target(ctx, &target)) {
+                fs_delete(ctx, target.name);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'R':  // Read
+            if (!scan_target(&sc, &target, 0) || !scan_int(&sc, &value) || value < 0 || value > 126) break;
+            if (enter_target(ctx, &target)) {
+                fs_read(ctx, target.name, value);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'W':  // Write
+            if (!scan_target(&sc, &target, 0) || !scan_int(&sc, &value) || value < 0 || value > 126) break;
+            if (enter_target(ctx, &target)) {
+                fs_write(ctx, target.name, value);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'G':  // Read a range of blocks
+        case 'P': {  // Write a range of blocks
+            int count;
+            if (!scan_target(&sc, &target, 0) || !scan_int(&sc, &value) || value < 0 || value > 126 ||
+                !scan_int(&sc, &count) || count <= 0 || count > 127) {
                 break;
+            }
+            if (enter_target(ctx, &target)) {
+                if (line[0] == 'G') fs_read_range(ctx, target.name, value, count);
+                else fs_write_range(ctx, target.name, value, count);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+        }
 
-            case 'Y':  // Change directory
-                {
-                    char name[6];
-                    if (sscanf(line, "Y %5s", name) != 1 || strlen(name) > 5) {
-                        fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                        continue;
-                    }
-                    fs_cd(name);
+        case 'I':  // Import a host file
+        case 'X': {  // Export to a host file
+            char host_path[1024];
+            if (!scan_target(&sc, &target, 0) || !scan_word(&sc, host_path, 1023)) break;
+            if (enter_target(ctx, &target)) {
+                if (line[0] == 'I') fs_import(ctx, target.name, host_path);
+                else fs_export(ctx, target.name, host_path);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+        }
+
+        case 'B':  // Buffer
+            if (len < 2) {  // Just "B"
+                memset(ctx->buffer, 0, BLOCK_SIZE);
+            } else {
+                fill_buffer(ctx, line + 2, len - 2);  // Skip "B "
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'L':  // List, optionally another directory given as a path
+            if (len != 1) {
+                if (!scan_word(&sc, target.path, sizeof(target.path) - 1) ||
+                    !strchr(target.path, '/') || !path_is_wellformed(target.path, 1)) {
+                    break;
                 }
-                break;
+                skip_spaces(&sc);
+                if (sc.pos != sc.end) break;
+                int saved_dir = ctx->current_dir_inode;
+                int dir = ctx->current_disk ? resolve_directory(ctx, target.path, strlen(target.path)) : saved_dir;
+                if (dir != -1) {
+                    ctx->current_dir_inode = dir;
+                    fs_ls(ctx);
+                    ctx->current_dir_inode = saved_dir;
+                }
+                end_command(ctx);
+                return 1;
+            }
+            fs_ls(ctx);
+            end_command(ctx);
+            return 1;
+
+        case 'E':  // Resize
+            if (!scan_target(&sc, &target, 0) || !scan_int(&sc, &value) || value <= 0 || value > 127) break;
+            if (enter_target(ctx, &target)) {
+                fs_resize(ctx, target.name, value);
+                leave_target(ctx, &target);
+            }
+            end_command(ctx);
+            return 1;
+
+        case 'O':  // Defragment
+            if (len != 1) break;
+            fs_defrag(ctx);
+            end_command(ctx);
+            return 1;
+
+        case 'F':  // Fragmentation report
+            if (len != 1) break;
+            fs_frag(ctx);
+            end_command(ctx);
+            return 1;
+
+        case 'Y':  // Change directory
+            if (!scan_target(&sc, &target, 1)) break;
+            if (!target.path[0]) {
+                fs_cd(ctx, target.name);
+            } else if (!ctx->current_disk) {
+                fprintf(ctx->err, "Error: No file system is mounted\n");
+            } else {
+                int dir = resolve_directory(ctx, target.path, strlen(target.path));
+                if (dir != -1) ctx->current_dir_inode = dir;
+            }
+            end_command(ctx);
+            return 1;
+    }
+    return 0;
+}
 
-            default:
-                fprintf(stderr, "Command Error: %s, %d\n", argv[1], line_num);
-                break;
+static void run_command_line(FsContext *ctx, const char *line, size_t len, const char *cmd_path, int line_num) {
+    if (!ctx->timing) {
+        if (!dispatch_command(ctx, line, len)) {
+            fprintf(ctx->err, "Command Error: %s, %d\n", cmd_path, line_num);
         }
+        return;
     }
 
-    fclose(cmd_file);
-    if (current_disk) {
-        free(current_disk);
+    uint64_t start = now_ns();
+    if (!dispatch_command(ctx, line, len)) {
+        fprintf(ctx->err, "Command Error: %s, %d\n", cmd_path, line_num);
+        ctx->command_errors++;
+        return;
     }
-    return 0;
-}
\ No newline at end of file
+    record_command(ctx, line[0], now_ns() - start);
+}
+
+// Cuts the next line from [*pos, end) the way fgets() with a 1024-byte
+// buffer cut them: longer lines continue as further lines, and a NUL byte
+// ends the command early. Returns 0 at the end of the data.
+static int next_line(const char **pos, const char *end, const char **line, size_t *len) {
+    if (*pos >= end) return 0;
+    size_t avail = end - *pos < 1023 ? (size_t)(end - *pos) : 1023;
+    const char *newline = memchr(*pos, '\n', avail);
+    size_t chunk = newline ? (size_t)(newline - *pos) : avail;
+    *line = *pos;
+    *pos += newline ? chunk + 1 : chunk;
+    *len = strnlen(*line, chunk);
+    return 1;
+}
+
+void fs_run_commands(FsContext *ctx, const char *data, size_t size, const char *cmd_path) {
+    const char *pos = data;
+    const char *end = data + size;
+    const char *line;
+    size_t len;
+    int line_num = 0;
+
+    while (next_line(&pos, end, &line, &len)) {
+        line_num++;
+        if (len == 0) continue;  // Skip empty lines
+        run_command_line(ctx, line, len, cmd_path, line_num);
+    }
+}
+
+void fs_for_each_host_file(const char *data, size_t size,
+                           void (*visit)(const char *path, void *arg), void *arg) {
+    const char *pos = data;
+    const char *end = data + size;
+    const char *line;
+    size_t len;
+    char path[1024 + sizeof(".journal")];
+
+    while (next_line(&pos, end, &line, &len)) {
+        if (len == 0) continue;
+        if (line[0] == 'M' && scan_mount(line, len, path)) {
+            visit(path, arg);
+            strcat(path, ".journal");
+            visit(path, arg);
+        } else if (line[0] == 'I' || line[0] == 'X') {
+            Scanner sc = {line + 1, line + len};
+            Target target;
+            if (scan_target(&sc, &target, 0) && scan_word(&sc, path, 1023)) visit(path, arg);
+        }
+    }
+}
+
+void fs_sync(FsContext *ctx) {
+    flush_superblock(ctx);
+    aio_wait(ctx);
+}
+
+// Returns to the state of a new context (nothing mounted, empty buffer,
+// root directory) after flushing, keeping the mount cache and statistics.
+// The active disk is parked with the others, so a later M of it switches
+// back without a mount if stat shows it unchanged.
+void fs_reset(FsContext *ctx) {
+    flush_superblock(ctx);
+    aio_wait(ctx);
+    mount_cache_refresh_current(ctx);
+    journal_checkpoint(ctx, 1);
+    if (!mount_table_park(ctx) && ctx->disk_fd != -1) close(ctx->disk_fd);
+    ctx->disk_fd = -1;
+    free(ctx->current_disk);
+    ctx->current_disk = NULL;
+    ctx->current_dir_inode = ROOT_INODE;
+    memset(&ctx->superblock, 0, sizeof(Superblock));
+    ctx->superblock_dirty = 0;
+    ctx->active_consistent = 0;
+    ctx->commands_since_flush = 0;
+    ctx->defrag_credit = 0;
+    block_cache_clear(ctx);
+    clear_buffer(ctx);
+}
+
+void fs_context_free(FsContext *ctx) {
+    if (!ctx) return;
+    fs_reset(ctx);
+    for (int i = 0; i < MOUNT_TABLE_SLOTS; i++) {
+        if (ctx->mount_table[i].valid) mount_table_drop(&ctx->mount_table[i], 1);
+    }
+    aio_free(ctx->aio);
+    free(ctx->block_cache);
+    free(ctx->block_cache_data);
+    free(ctx);
+}
@@ -1,3 +1,10 @@
+#ifndef FS_SIM_H
+#define FS_SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
 typedef struct {
 	char name[5];        // Name of the file/directory (not necessarily null terminated)
 	uint8_t used_size;   // State of inode and size of the file/directory
@@ -10,13 +17,80 @@ typedef struct {
 	Inode inode[126];
 } Superblock;
 
-void fs_mount(char *new_disk_name);
-void fs_create(char name[5], int size);
-void fs_delete(char name[5]);
-void fs_read(char name[5], int block_num);
-void fs_write(char name[5], int block_num);
-void fs_buff(char buff[1024]);
-void fs_ls(void);
-void fs_resize(char name[5], int new_size);
-void fs_defrag(void);
-void fs_cd(char name[5]);
\ No newline at end of file
+// Placement policy for new files and relocated (resized) files
+typedef enum {
+	ALLOC_FIRST_FIT,
+	ALLOC_BEST_FIT,
+	ALLOC_WORST_FIT,
+	ALLOC_NEXT_FIT
+} AllocPolicy;
+
+// Engine for asynchronous block writes; AIO_AUTO and AIO_URING fall back
+// to threads where io_uring is unavailable
+typedef enum {
+	AIO_OFF,
+	AIO_AUTO,
+	AIO_URING,
+	AIO_THREADS
+} AioEngine;
+
+// One simulator instance: mounted disk, buffer, current directory, caches
+// and statistics. Contexts are independent of each other; a context must
+// not be used by two threads at once.
+typedef struct FsContext FsContext;
+
+FsContext *fs_context_new(void);
+void fs_context_free(FsContext *ctx);  // Flushes and unmounts first
+
+// Settings; the defaults are stdout/stderr, a flush after every command,
+// no journal, first fit, no incremental defragmentation, no timing, freed
+// blocks zeroed by writing, synchronous writes and no block cache
+void fs_set_output(FsContext *ctx, FILE *out, FILE *err);
+void fs_set_directory(FsContext *ctx, int dir_fd);  // For relative disk names; default AT_FDCWD
+void fs_set_flush_interval(FsContext *ctx, int commands);
+void fs_set_flush_ms(FsContext *ctx, int ms);      // Also flush changes once they are ms old
+void fs_set_journal(FsContext *ctx, int enabled);  // Commit through <disk>.journal
+void fs_set_alloc_policy(FsContext *ctx, AllocPolicy policy);
+void fs_set_defrag_budget(FsContext *ctx, int blocks);
+void fs_set_timing(FsContext *ctx, int enabled);
+void fs_set_hole_punching(FsContext *ctx, int enabled);  // Punch freed blocks out of the image
+void fs_set_async_io(FsContext *ctx, AioEngine engine);  // Queued writes complete once per command
+void fs_set_block_cache(FsContext *ctx, int blocks);     // Blocks cached for R; 0 = off
+
+// Runs a command file's contents; script_name appears in Command Error
+// messages
+void fs_run_commands(FsContext *ctx, const char *data, size_t size, const char *script_name);
+void fs_sync(FsContext *ctx);   // Writes back a pending superblock and queued writes
+void fs_reset(FsContext *ctx);  // Flushes and unmounts, keeping caches, parked disks and statistics
+
+// Calls visit with every host file a command file names, in order: the
+// disk of each well-formed M command and then its <disk>.journal, and the
+// host file of each well-formed I and X command
+void fs_for_each_host_file(const char *data, size_t size,
+                           void (*visit)(const char *path, void *arg), void *arg);
+
+void fs_write_stats(FsContext *ctx, FILE *out);             // JSON report
+void fs_write_mount_cache_stats(FsContext *ctx, FILE *out); // One summary line
+void fs_write_block_cache_stats(FsContext *ctx, FILE *out); // One summary line, none when off
+void fs_merge_stats(FsContext *ctx, const FsContext *from); // Adds from's counters to ctx
+
+// Commands. Unlike fs_run_commands, direct calls leave the superblock
+// cached until the next mount, fs_sync or fs_reset. Names are looked up in
+// the current directory; path arguments are resolved by fs_run_commands.
+void fs_mount(FsContext *ctx, char *new_disk_name);
+void fs_create(FsContext *ctx, char name[5], int size);
+void fs_delete(FsContext *ctx, char name[5]);
+void fs_read(FsContext *ctx, char name[5], int block_num);
+void fs_write(FsContext *ctx, char name[5], int block_num);
+void fs_read_range(FsContext *ctx, char name[5], int first, int count);
+void fs_write_range(FsContext *ctx, char name[5], int first, int count);
+void fs_import(FsContext *ctx, char name[5], const char *host_path);  // Host paths resolve like disk names
+void fs_export(FsContext *ctx, char name[5], const char *host_path);
+void fs_buff(FsContext *ctx, char buff[1024]);
+void fs_ls(FsContext *ctx);
+void fs_resize(FsContext *ctx, char name[5], int new_size);
+void fs_defrag(FsContext *ctx);
+void fs_frag(FsContext *ctx);
+void fs_cd(FsContext *ctx, char name[5]);
+
+#endif